@@ -0,0 +1,152 @@
+#ifndef __ROUTER_CHECKSUM_H__
+#define __ROUTER_CHECKSUM_H__
+
+// Internet checksum (RFC 1071) shared by the HAL and the homework code.
+// Words are summed in host order into a 64-bit accumulator and the carries
+// are folded once at the end; the result is converted back to network order
+// by checksumFold(), which works because the one's complement sum is
+// byte-order independent.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define ROUTER_CHECKSUM_SIMD
+#endif
+
+// below this length the SIMD setup costs more than it saves (IP headers)
+#define CHECKSUM_SIMD_MIN 64
+
+static inline uint64_t checksumPartialScalar(const uint8_t *p, size_t len,
+                                             uint64_t sum) {
+  uint32_t w[4];
+  while (len >= 16) {
+    memcpy(w, p, 16);
+    sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+    p += 16;
+    len -= 16;
+  }
+  while (len >= 4) {
+    memcpy(w, p, 4);
+    sum += w[0];
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    uint16_t h;
+    memcpy(&h, p, 2);
+    sum += h;
+    p += 2;
+    len -= 2;
+  }
+  if (len) {
+    // odd trailing byte, padded with a zero byte
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sum += (uint32_t)p[0] << 8;
+#else
+    sum += p[0];
+#endif
+  }
+  return sum;
+}
+
+#ifdef ROUTER_CHECKSUM_SIMD
+static inline uint64_t checksumPartialSSE2(const uint8_t *p, size_t len,
+                                           uint64_t sum) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  while (len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    // widen 32-bit words to 64-bit lanes, no carry is ever lost
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    p += 16;
+    len -= 16;
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return checksumPartialScalar(p, len, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2"))) static inline uint64_t
+checksumPartialAVX2(const uint8_t *p, size_t len, uint64_t sum) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  while (len >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+    acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+    p += 32;
+    len -= 32;
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return checksumPartialScalar(p, len,
+                               sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+#endif
+
+typedef uint64_t (*checksum_partial_fn)(const uint8_t *, size_t, uint64_t);
+
+static inline checksum_partial_fn checksumSelect() {
+#ifdef ROUTER_CHECKSUM_SIMD
+  static checksum_partial_fn fn = NULL;
+  if (!fn) {
+    __builtin_cpu_init();
+    fn = __builtin_cpu_supports("avx2") ? checksumPartialAVX2
+                                        : checksumPartialSSE2;
+  }
+  return fn;
+#else
+  return checksumPartialScalar;
+#endif
+}
+
+/**
+ * @brief 把 data 开始的 len 字节累加到一个未折叠的 64 位校验和中
+ *
+ * 可以多次调用来累加不连续的数据（比如 UDP 伪首部和载荷），除最后一段外每段长度需为偶数
+ *
+ * @param data IN，待累加的数据
+ * @param len IN，数据长度，单位是字节
+ * @param sum IN，之前累加的结果，第一次调用时为 0
+ * @return uint64_t 累加后的结果，交给 checksumFold 折叠
+ */
+static inline uint64_t checksumPartial(const void *data, size_t len,
+                                       uint64_t sum) {
+  const uint8_t *p = (const uint8_t *)data;
+  if (len < CHECKSUM_SIMD_MIN)
+    return checksumPartialScalar(p, len, sum);
+  return checksumSelect()(p, len, sum);
+}
+
+/**
+ * @brief 把 checksumPartial 的结果折叠为 16 位反码和
+ *
+ * @param sum IN，checksumPartial 的结果
+ * @return uint16_t 按大端序解释的 16 位反码和（未取反）
+ */
+static inline uint16_t checksumFold(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (uint16_t)sum;
+#else
+  return __builtin_bswap16((uint16_t)sum);
+#endif
+}
+
+/**
+ * @brief 计算 data 开始的 len 字节的 Internet 校验和
+ *
+ * @param data IN，待计算的数据，其中的校验和字段应已清零
+ * @param len IN，数据长度，单位是字节
+ * @return uint16_t 按大端序解释的校验和，高字节写在前
+ */
+static inline uint16_t checksum(const void *data, size_t len) {
+  return (uint16_t)~checksumFold(checksumPartial(data, len, 0));
+}
+
+#endif
@@ -9,6 +9,8 @@
 #include <arpa/inet.h>
 #elif defined ROUTER_BACKEND_STDIO
 #include <arpa/inet.h>
+#elif defined ROUTER_BACKEND_XDP
+#include <arpa/inet.h>
 #elif defined ROUTER_BACKEND_XILINX
 typedef uint32_t in_addr_t;
 #endif
@@ -16,6 +18,10 @@ typedef uint32_t in_addr_t;
 
 #define N_IFACE_ON_BOARD 2
 typedef uint8_t macaddr_t[6];
+// 各后端在 IPv4 报文前的链路层头部的最大长度（以太网头加上 802.1Q 标签）
+#define HAL_L2_HEADER_MAX 18
+// 转发线程个数的上限，见 HAL_SetWorkerCount
+#define HAL_WORKERS_MAX 16
 
 enum HAL_ERROR_NUMBER {
   HAL_ERR_INVALID_PARAMETER = -1000,
@@ -25,6 +31,7 @@ enum HAL_ERROR_NUMBER {
   HAL_ERR_EOF,
   HAL_ERR_NOT_SUPPORTED,
   HAL_ERR_UNKNOWN,
+  HAL_ERR_QUEUE_FULL, // 发送队列已满，内核来不及发送，帧已被丢弃
 };
 
 #ifdef __cplusplus
@@ -56,6 +63,10 @@ uint64_t HAL_GetTicks();
  * 报文进行查询，待对方主机回应后可重新调用本接口从表中查询 部分后端会限制发送的
  * ARP 报文数量，如每秒向同一个主机最多发送一个 ARP 报文
  *
+ * 最近几秒内被查询过的表项视为仍在使用，部分后端会在它们过期前用单播 ARP
+ * 请求重新确认，确认期间原有的 MAC 地址照常返回；缓存了结果的调用者应至少每秒对
+ * 在用的下一跳重新调用一次本接口，这样它们就不会过期
+ *
  * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
  * @param ip IN，要查询的 IP 地址
  * @param o_mac OUT，查询结果 MAC 地址
@@ -92,6 +103,30 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index);
 
+// HAL_ReceiveIPPacketBatch 中的一个报文
+typedef struct {
+  uint8_t *buffer;   // IN，接收缓冲区，由调用者分配
+  size_t size;       // IN，接收缓冲区大小
+  size_t length;     // OUT，报文的实际长度，可能大于 size，此时只复制了前 size 字节
+  int if_index;      // OUT，报文来源的接口号
+  macaddr_t src_mac; // OUT，IPv4 报文下层的源 MAC 地址
+  macaddr_t dst_mac; // OUT，IPv4 报文下层的目的 MAC 地址
+} HAL_IPPacket;
+
+/**
+ * @brief 一次接收最多 count 个 IPv4 报文，语义同 HAL_ReceiveIPPacket
+ *
+ * 等待至多 timeout 毫秒直到收到第一个报文，之后只收取已经到达的报文，不再等待
+ *
+ * @param if_index_mask IN，接口索引号的 bitset，同 HAL_ReceiveIPPacket
+ * @param packets IN/OUT，报文数组，调用者填好 buffer 和 size
+ * @param count IN，packets 的长度
+ * @param timeout IN，设置接收超时时间（毫秒），-1 表示无限等待
+ * @return int >0 表示实际接收的报文个数，=0 表示超时返回，<0 表示发生错误
+ */
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_IPPacket *packets,
+                             int count, int64_t timeout);
+
 /**
  * @brief 发送一个 IP 报文，它的源 MAC 地址就是对应接口的 MAC 地址
  *
@@ -104,6 +139,203 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac);
 
+/**
+ * @brief 发送一个 IP 报文，与 HAL_SendIPPacket 相同，但链路层头部直接写在 buffer
+ * 前面的空间里，不需要复制报文，也不需要分配内存
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param buffer IN，发送缓冲区，buffer 之前至少要有 HAL_L2_HEADER_MAX 字节可以被覆盖
+ * @param length IN，待发送报文的长度
+ * @param dst_mac IN，IPv4 报文下层的目的 MAC 地址
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_SendIPPacketInPlace(int if_index, uint8_t *buffer, size_t length,
+                            macaddr_t dst_mac);
+
+/**
+ * @brief 获取 ARP 表的版本号，每当 ARP 表中有表项新增、改变或被删除（老化、被挤出）时它会变化
+ *
+ * 缓存了 HAL_ArpGetMacAddress 结果的调用者可以据此判断缓存是否过期
+ *
+ * @return uint32_t 版本号
+ */
+uint32_t HAL_GetArpVersion();
+
+/**
+ * @brief 暂存一个因为下一跳的 MAC 地址未知而无法发出的 IPv4 报文
+ *
+ * 在 HAL_ArpGetMacAddress 失败后调用，报文被复制到 HAL 中；
+ * 收到下一跳的 ARP 报文时，所有发往它的暂存报文会补上链路层头部一起发出，
+ * 一段时间内（目前为 5 秒）仍未解析的则被丢弃。每个下一跳最多暂存 8 个，
+ * 所有下一跳一共最多暂存 64 个，超出时返回失败
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param nexthop IN，下一跳的 IP 地址，即传给 HAL_ArpGetMacAddress 的地址
+ * @param buffer IN，要发出的 IPv4 报文
+ * @param length IN，报文的长度，不超过 2048
+ * @return int 0 表示成功，非 0 为失败，不支持的后端返回 HAL_ERR_NOT_SUPPORTED
+ */
+int HAL_HoldIPPacket(int if_index, in_addr_t nexthop, const uint8_t *buffer,
+                     size_t length);
+
+/**
+ * @brief 构造从某个接口发往 dst_mac 的 IPv4 报文的链路层头部
+ *
+ * 头部只和 if_index、dst_mac 有关，可以预先构造好并重复使用
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param dst_mac IN，IPv4 报文下层的目的 MAC 地址
+ * @param header OUT，头部，由调用者分配，至少 HAL_L2_HEADER_MAX 字节
+ * @return int >0 表示头部的长度，<0 表示发生错误
+ */
+int HAL_BuildL2Header(int if_index, macaddr_t dst_mac, uint8_t *header);
+
+/**
+ * @brief 发送一个已经带有链路层头部的帧，头部应由 HAL_BuildL2Header 构造
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param frame IN，链路层头部和紧随其后的 IPv4 报文
+ * @param length IN，帧的总长度
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_SendFrame(int if_index, uint8_t *frame, size_t length);
+
+/**
+ * @brief 批量发送若干个 IP 报文，尽量用一次系统调用发出
+ *
+ * 报文会先放入该接口的发送队列，函数返回前整个队列都会被发出
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param packets IN，报文数组，使用其中的 buffer、length 和 dst_mac
+ * @param count IN，packets 的长度
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_SendIPPacketBatch(int if_index, HAL_IPPacket *packets, int count);
+
+/**
+ * @brief 把一个已经带有链路层头部的帧放入接口的发送队列，frame 可以在返回后立即复用
+ *
+ * 队列满时会自动发出，否则要等到 HAL_FlushSendQueues 调用时才发出；
+ * 如果内核还没有发完队列中的帧，腾不出位置，这个帧会被丢弃
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param frame IN，链路层头部和紧随其后的 IPv4 报文
+ * @param length IN，帧的总长度
+ * @return int 0 表示成功，HAL_ERR_QUEUE_FULL 表示帧因队列已满被丢弃，其他非 0 值为失败
+ */
+int HAL_QueueFrame(int if_index, uint8_t *frame, size_t length);
+
+/**
+ * @brief 发出所有接口发送队列中的帧，建议在处理完一批接收的报文后、再次接收之前调用
+ *
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_FlushSendQueues();
+
+// HAL_BorrowIPPacketBatch 借出的一个报文，它的内存属于 HAL
+typedef struct {
+  uint8_t *buffer;   // OUT，IPv4 报文，可以原地修改，前面至少有 HAL_L2_HEADER_MAX 字节可以被覆盖；归还后被置为 NULL
+  size_t length;     // OUT，报文的长度，发送前可以改小
+  int if_index;      // OUT，报文来源的接口号
+  macaddr_t src_mac; // OUT，IPv4 报文下层的源 MAC 地址
+  macaddr_t dst_mac; // OUT，IPv4 报文下层的目的 MAC 地址
+  uintptr_t handle;  // OUT，HAL 内部使用，调用者不要修改
+} HAL_BorrowedPacket;
+
+/**
+ * @brief 与 HAL_ReceiveIPPacketBatch 相同，但不复制报文，而是直接借出 HAL 接收报文的内存
+ *
+ * 每个借出的报文都必须用 HAL_QueueBorrowedPacket 或 HAL_ReleaseBorrowedPacket
+ * 归还且只归还一次；借出的报文较多时 HAL 可能收不到新的报文，所以应尽快归还
+ *
+ * @param if_index_mask IN，接口索引号的 bitset，同 HAL_ReceiveIPPacket
+ * @param packets OUT，报文数组
+ * @param count IN，packets 的长度
+ * @param timeout IN，设置接收超时时间（毫秒），-1 表示无限等待
+ * @return int >0 表示实际借出的报文个数，=0 表示超时返回，<0 表示发生错误
+ */
+int HAL_BorrowIPPacketBatch(int if_index_mask, HAL_BorrowedPacket *packets,
+                            int count, int64_t timeout);
+
+/**
+ * @brief 把借出的报文原地放入接口的发送队列并归还，语义同 HAL_QueueFrame
+ *
+ * 调用者需要先在 buffer 之前的 header_len 字节写好链路层头部（如 HAL_BuildL2Header 的结果）
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]，可以与报文来源的接口不同
+ * @param packet IN/OUT，借出的报文，发送 buffer 之前的链路层头部和 length 字节的报文
+ * @param header_len IN，链路层头部的长度，不超过 HAL_L2_HEADER_MAX
+ * @return int 0 表示成功，非 0 为失败；失败时报文同样已经归还
+ */
+int HAL_QueueBorrowedPacket(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len);
+
+/**
+ * @brief 归还一个不再需要的借出的报文
+ *
+ * @param packet IN/OUT，借出的报文
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_ReleaseBorrowedPacket(HAL_BorrowedPacket *packet);
+
+// 一个接口的接收队列的统计信息
+typedef struct {
+  uint32_t size;       // 队列的容量
+  uint32_t depth;      // 当前在队列中等待处理的报文数
+  uint32_t high_water; // 曾经同时等待处理的报文数的最大值
+  uint64_t drops;      // 因队列已满而丢弃的报文数
+} HAL_RxQueueStats;
+
+/**
+ * @brief 获取一个接口的接收队列的统计信息
+ *
+ * 只有为每个接口单独开一个线程接收的后端才有接收队列（目前是编译时定义了 HAL_RX_THREADS
+ * 的 Linux 后端）：接收线程把收到的帧放入队列，HAL_ReceiveIPPacket 等函数再从队列中取出处理，
+ * 处理不及时导致队列满时，新收到的帧会被丢弃
+ *
+ * @param if_index IN，接口索引号，[0, N_IFACE_ON_BOARD-1]
+ * @param stats OUT，统计信息
+ * @return int 0 表示成功，非 0 为失败，没有接收队列的后端返回 HAL_ERR_NOT_SUPPORTED
+ */
+int HAL_GetRxQueueStats(int if_index, HAL_RxQueueStats *stats);
+
+/**
+ * @brief 设置转发线程的个数，默认为 1，需要在 HAL_Init 之前调用
+ *
+ * 有多个转发线程时，收到的 IPv4 报文按照源地址、目的地址、协议和端口号的哈希值分给各个线程，
+ * 同一个流的报文总是交给同一个线程，顺序不变；ARP 报文和发给路由器自己的报文（目的地址是接口的地址、
+ * 组播或广播地址）总是交给 0 号线程。每个线程有自己的发送队列。
+ * 目前只有编译时定义了 HAL_RX_THREADS 的 Linux 后端支持多个转发线程
+ *
+ * @param count IN，转发线程的个数，[1, HAL_WORKERS_MAX]
+ * @return int 0 表示成功，非 0 为失败，不支持的后端在 count > 1 时返回 HAL_ERR_NOT_SUPPORTED
+ */
+int HAL_SetWorkerCount(int count);
+
+/**
+ * @brief 让调用者所在的线程担任第 worker 个转发线程，此后它收到和发出的都是这个转发线程的报文
+ *
+ * 没有调用过本函数的线程担任 0 号转发线程，每个转发线程只能由一个线程担任，借出的报文也只能由借出它的线程归还。
+ * 不同的转发线程可以同时调用接收和发送报文的函数、HAL_ArpGetMacAddress、HAL_GetArpVersion、
+ * HAL_HoldIPPacket 和 HAL_BuildL2Header，HAL_GetTicks 和 HAL_WakeWorker 可以在任何线程中调用，其余的函数只能由 0 号转发线程调用
+ *
+ * @param worker IN，转发线程的编号，[0, HAL_SetWorkerCount 设置的个数 - 1]
+ * @return int 0 表示成功，非 0 为失败
+ */
+int HAL_SetWorker(int worker);
+
+/**
+ * @brief 让第 worker 个转发线程正在等待的（或者下一次等待的）HAL_ReceiveIPPacketBatch
+ * 或 HAL_BorrowIPPacketBatch 立即返回 0，可以在任何线程中调用
+ *
+ * 用于把其他线程（如处理路由协议的线程）交给转发线程发送的报文及时发出，而不必让转发线程定期醒来查看。
+ * 目前只有 Linux 和 AF_XDP 后端支持
+ *
+ * @param worker IN，转发线程的编号，[0, HAL_SetWorkerCount 设置的个数 - 1]
+ * @return int 0 表示成功，非 0 为失败，不支持的后端返回 HAL_ERR_NOT_SUPPORTED
+ */
+int HAL_WakeWorker(int worker);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,8 +3,14 @@
 
 // don't include this file in your own code.
 #include "router_hal.h"
+#include "router_checksum.h"
+#include <stdio.h>
 #include <string.h>
 
+// defined by every backend
+extern int debugEnabled;
+extern in_addr_t interface_addrs[N_IFACE_ON_BOARD];
+
 // send igmp join to the multicast address
 void HAL_JoinIGMPGroup(int if_index, in_addr_t ip) {
   uint8_t buffer[40] = {
@@ -23,18 +29,486 @@ void HAL_JoinIGMPGroup(int if_index, in_addr_t ip) {
       0xe0, 0x00, 0x00, 0x09  // RIP Multicast
   };
   memcpy(&buffer[12], &ip, sizeof(in_addr_t));
-  uint32_t ip_chksum = 0;
-  for (int i = 0; i < 12; i++) {
-    ip_chksum += ((uint16_t *)buffer)[i];
-  }
-  while (ip_chksum >= 0x10000) {
-    ip_chksum -= 0x10000;
-    ip_chksum += 1;
-  }
-  uint16_t chksum = ~ip_chksum;
-  memcpy(&buffer[10], &chksum, sizeof(uint16_t));
+  uint16_t chksum = checksum(buffer, 24);
+  buffer[10] = (uint8_t)(chksum >> 8), buffer[11] = (uint8_t)chksum;
   macaddr_t dst_mac = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x16};
   HAL_SendIPPacket(if_index, buffer, sizeof(buffer), dst_mac);
 }
 
+// backends that cannot lend the memory they receive into copy each packet
+// into one of these slots instead, which still saves the caller its copy
+#define HAL_LEND_SLOTS 64
+#define HAL_LEND_SLOT_SIZE 2048
+struct HAL_LendPool {
+  uint8_t slots[HAL_LEND_SLOTS][HAL_L2_HEADER_MAX + HAL_LEND_SLOT_SIZE];
+  int free_slots[HAL_LEND_SLOTS];
+  int n_free;
+};
+
+static inline struct HAL_LendPool *lendPool() {
+  static struct HAL_LendPool pool;
+  static int inited = 0;
+  if (!inited) {
+    for (int i = 0; i < HAL_LEND_SLOTS; i++) {
+      pool.free_slots[i] = i;
+    }
+    pool.n_free = HAL_LEND_SLOTS;
+    inited = 1;
+  }
+  return &pool;
+}
+
+static inline int lendBorrow(int if_index_mask, HAL_BorrowedPacket *packets,
+                             int count, int64_t timeout) {
+  struct HAL_LendPool *pool = lendPool();
+  if (packets == NULL || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (count > pool->n_free) {
+    count = pool->n_free;
+  }
+  if (count == 0) {
+    // every slot is still lent out
+    return HAL_ERR_UNKNOWN;
+  }
+  // receive into the slots on top of the free stack
+  HAL_IPPacket rx[HAL_LEND_SLOTS];
+  int slots[HAL_LEND_SLOTS];
+  for (int i = 0; i < count; i++) {
+    slots[i] = pool->free_slots[pool->n_free - 1 - i];
+    rx[i].buffer = &pool->slots[slots[i]][HAL_L2_HEADER_MAX];
+    rx[i].size = HAL_LEND_SLOT_SIZE;
+  }
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, rx, count, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  pool->n_free -= res;
+  int n = 0;
+  for (int i = 0; i < res; i++) {
+    if (rx[i].length > rx[i].size) {
+      // does not fit a slot, drop it
+      pool->free_slots[pool->n_free++] = slots[i];
+      continue;
+    }
+    HAL_BorrowedPacket *p = &packets[n++];
+    p->buffer = rx[i].buffer;
+    p->length = rx[i].length;
+    p->if_index = rx[i].if_index;
+    memcpy(p->src_mac, rx[i].src_mac, sizeof(macaddr_t));
+    memcpy(p->dst_mac, rx[i].dst_mac, sizeof(macaddr_t));
+    p->handle = slots[i];
+  }
+  return n;
+}
+
+static inline int lendRelease(HAL_BorrowedPacket *packet) {
+  struct HAL_LendPool *pool = lendPool();
+  if (packet == NULL || packet->buffer == NULL ||
+      packet->handle >= HAL_LEND_SLOTS) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  pool->free_slots[pool->n_free++] = packet->handle;
+  packet->buffer = NULL;
+  return 0;
+}
+
+static inline int lendQueue(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len) {
+  if (packet == NULL || packet->buffer == NULL ||
+      header_len > HAL_L2_HEADER_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int res = HAL_QueueFrame(if_index, packet->buffer - header_len,
+                           header_len + packet->length);
+  lendRelease(packet);
+  return res;
+}
+
+// ARP cache shared by the backends: a fixed-size open-addressing table
+// keyed by (ip, if_index). A key lives in one of the HAL_ARP_PROBE slots
+// following its hash, so a lookup touches a few adjacent cache lines and
+// never allocates; when they are all taken the least recently used entry
+// is evicted. Times are HAL_GetTicks() truncated to 32 bits.
+#define HAL_ARP_CACHE_BITS 10
+#define HAL_ARP_CACHE_SIZE (1 << HAL_ARP_CACHE_BITS)
+#define HAL_ARP_PROBE 8
+#define HAL_ARP_REACHABLE_MS 60000 // confirmed entries turn stale after this
+#define HAL_ARP_STALE_MS 60000     // and are dropped if not confirmed again
+#define HAL_ARP_INCOMPLETE_MS 5000 // unanswered entries are dropped after this
+#define HAL_ARP_REQUEST_MS 1000    // at most one request per entry this often
+#define HAL_ARP_AGE_MS 1000        // how often arpAge walks the table
+// entries looked up within this long are in use: arpAge probes them this
+// long before they turn stale, and while they are stale, so that they are
+// confirmed again without ever going away
+#define HAL_ARP_REFRESH_MS 5000
+
+enum HAL_ArpState {
+  HAL_ARP_FREE = 0,
+  HAL_ARP_INCOMPLETE, // request sent, no answer yet
+  HAL_ARP_REACHABLE,  // confirmed recently
+  HAL_ARP_STALE,      // still used, but not confirmed for a while
+  HAL_ARP_PERMANENT   // our own addresses, never aged or evicted
+};
+
+struct HAL_ArpEntry {
+  in_addr_t ip;
+  uint32_t updated;   // when it was created or last confirmed
+  uint32_t requested; // when the last request for it was sent
+  uint32_t used;      // when it was last looked up, for LRU
+  macaddr_t mac;      // valid from HAL_ARP_REACHABLE on
+  uint8_t if_index;
+  uint8_t state;
+};
+
+struct HAL_ArpCache {
+  struct HAL_ArpEntry entries[HAL_ARP_CACHE_SIZE];
+  // bumped whenever a resolved MAC appears, changes or goes away; written
+  // atomically so that it can be read without holding the cache
+  uint32_t version;
+  uint32_t aged;    // when arpAge last walked the table
+};
+
+static inline void arpBumpVersion(struct HAL_ArpCache *c) {
+  __atomic_store_n(&c->version, c->version + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t arpHash(in_addr_t ip, int if_index) {
+  return ((ip ^ ((uint32_t)if_index << 24)) * 0x9e3779b1u) >>
+         (32 - HAL_ARP_CACHE_BITS);
+}
+
+static inline int arpResolved(const struct HAL_ArpEntry *e) {
+  return e->state >= HAL_ARP_REACHABLE;
+}
+
+static inline struct HAL_ArpEntry *arpFind(struct HAL_ArpCache *c, in_addr_t ip,
+                                           int if_index) {
+  uint32_t h = arpHash(ip, if_index);
+  for (int i = 0; i < HAL_ARP_PROBE; i++) {
+    struct HAL_ArpEntry *e = &c->entries[(h + i) & (HAL_ARP_CACHE_SIZE - 1)];
+    if (e->state != HAL_ARP_FREE && e->ip == ip && e->if_index == if_index) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// the entry for (ip, if_index) or NULL, marked as used
+static inline struct HAL_ArpEntry *arpLookup(struct HAL_ArpCache *c,
+                                             in_addr_t ip, int if_index,
+                                             uint32_t now) {
+  struct HAL_ArpEntry *e = arpFind(c, ip, if_index);
+  if (e) {
+    e->used = now;
+  }
+  return e;
+}
+
+static inline void arpRemove(struct HAL_ArpCache *c, struct HAL_ArpEntry *e) {
+  if (arpResolved(e)) {
+    arpBumpVersion(c);
+  }
+  e->state = HAL_ARP_FREE;
+}
+
+// the entry for (ip, if_index), created as HAL_ARP_INCOMPLETE in a free
+// slot or over the least recently used one if it is missing. NULL only if
+// every slot it could go to is permanent
+static inline struct HAL_ArpEntry *arpInsert(struct HAL_ArpCache *c,
+                                             in_addr_t ip, int if_index,
+                                             uint32_t now) {
+  uint32_t h = arpHash(ip, if_index);
+  struct HAL_ArpEntry *victim = NULL;
+  for (int i = 0; i < HAL_ARP_PROBE; i++) {
+    struct HAL_ArpEntry *e = &c->entries[(h + i) & (HAL_ARP_CACHE_SIZE - 1)];
+    if (e->state == HAL_ARP_FREE) {
+      if (!victim || victim->state != HAL_ARP_FREE) {
+        victim = e;
+      }
+    } else if (e->ip == ip && e->if_index == if_index) {
+      return e;
+    } else if (e->state != HAL_ARP_PERMANENT &&
+               (!victim || (victim->state != HAL_ARP_FREE &&
+                            now - e->used > now - victim->used))) {
+      victim = e;
+    }
+  }
+  if (!victim) {
+    return NULL;
+  }
+  if (victim->state != HAL_ARP_FREE) {
+    arpRemove(c, victim);
+  }
+  memset(victim, 0, sizeof(*victim));
+  victim->ip = ip;
+  victim->if_index = if_index;
+  victim->state = HAL_ARP_INCOMPLETE;
+  victim->updated = victim->used = now;
+  victim->requested = now - HAL_ARP_REQUEST_MS; // the first request is due
+  return victim;
+}
+
+// record that ip on if_index is at mac
+static inline void arpLearn(struct HAL_ArpCache *c, in_addr_t ip, int if_index,
+                            const macaddr_t mac, uint32_t now) {
+  struct HAL_ArpEntry *e = arpInsert(c, ip, if_index, now);
+  if (!e || e->state == HAL_ARP_PERMANENT) {
+    return;
+  }
+  if (!arpResolved(e) || memcmp(e->mac, mac, sizeof(macaddr_t)) != 0) {
+    memcpy(e->mac, mac, sizeof(macaddr_t));
+    arpBumpVersion(c);
+  }
+  e->state = HAL_ARP_REACHABLE;
+  e->updated = now;
+}
+
+static inline void arpAddPermanent(struct HAL_ArpCache *c, in_addr_t ip,
+                                   int if_index, const macaddr_t mac) {
+  struct HAL_ArpEntry *e = arpInsert(c, ip, if_index, 0);
+  if (e) {
+    memcpy(e->mac, mac, sizeof(macaddr_t));
+    e->state = HAL_ARP_PERMANENT;
+  }
+}
+
+// whether a request for e may be sent now; if so it is counted as sent
+static inline int arpRequestDue(struct HAL_ArpEntry *e, uint32_t now) {
+  if (now - e->requested < HAL_ARP_REQUEST_MS) {
+    return 0;
+  }
+  e->requested = now;
+  return 1;
+}
+
+// sends a unicast request for ip to mac, the MAC it is known at
+typedef void (*HAL_ArpProbe)(int if_index, in_addr_t ip, const uint8_t *mac);
+
+// move entries along REACHABLE -> STALE -> gone and drop unanswered ones;
+// entries in use that are about to go stale are handed to probe (if not
+// NULL) at most every HAL_ARP_REQUEST_MS while they keep their MAC. Cheap
+// to call often, it walks the table at most every HAL_ARP_AGE_MS. Returns
+// the number of probes, so that they can be flushed together
+static inline int arpAge(struct HAL_ArpCache *c, uint32_t now, HAL_ArpProbe probe) {
+  if (now - c->aged < HAL_ARP_AGE_MS) {
+    return 0;
+  }
+  c->aged = now;
+  int probes = 0;
+  for (int i = 0; i < HAL_ARP_CACHE_SIZE; i++) {
+    struct HAL_ArpEntry *e = &c->entries[i];
+    uint32_t age = now - e->updated;
+    if (e->state == HAL_ARP_REACHABLE && age >= HAL_ARP_REACHABLE_MS) {
+      e->state = HAL_ARP_STALE;
+    } else if ((e->state == HAL_ARP_STALE &&
+                age >= HAL_ARP_REACHABLE_MS + HAL_ARP_STALE_MS) ||
+               (e->state == HAL_ARP_INCOMPLETE && age >= HAL_ARP_INCOMPLETE_MS)) {
+      arpRemove(c, e);
+      continue;
+    }
+    if (probe &&
+        (e->state == HAL_ARP_STALE ||
+         (e->state == HAL_ARP_REACHABLE &&
+          age >= HAL_ARP_REACHABLE_MS - HAL_ARP_REFRESH_MS)) &&
+        now - e->used < HAL_ARP_REFRESH_MS && arpRequestDue(e, now)) {
+      probe(e->if_index, e->ip, e->mac);
+      probes++;
+    }
+  }
+  return probes;
+}
+
+// an ARP request for ip sent from if_index: broadcast, or unicast to
+// dst_mac to confirm a known neighbor
+static inline void arpBuildRequest(int if_index, in_addr_t ip,
+                                   const uint8_t *dst_mac, uint8_t buffer[64]) {
+  memset(buffer, 0, 64);
+  // dst mac
+  if (dst_mac) {
+    memcpy(buffer, dst_mac, sizeof(macaddr_t));
+  } else {
+    memset(buffer, 0xff, sizeof(macaddr_t));
+  }
+  // src mac
+  macaddr_t mac;
+  HAL_GetInterfaceMacAddress(if_index, mac);
+  memcpy(&buffer[6], mac, sizeof(macaddr_t));
+  // ARP
+  buffer[12] = 0x08;
+  buffer[13] = 0x06;
+  // hardware type
+  buffer[15] = 0x01;
+  // protocol type
+  buffer[16] = 0x08;
+  // hardware size
+  buffer[18] = 0x06;
+  // protocol size
+  buffer[19] = 0x04;
+  // opcode
+  buffer[21] = 0x01;
+  // sender
+  memcpy(&buffer[22], mac, sizeof(macaddr_t));
+  memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
+  // target
+  memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+}
+
+// queue a request confirming that ip is still at mac, e.g. as the arpAge
+// callback of Ethernet backends, so that the probes go out in one flush
+static inline void arpQueueProbe(int if_index, in_addr_t ip, const uint8_t *mac) {
+  if (debugEnabled) {
+    const uint8_t *a = (const uint8_t *)&ip;
+    fprintf(stderr, "HAL: refreshing arp entry of %u.%u.%u.%u\n", a[0], a[1],
+            a[2], a[3]);
+  }
+  uint8_t buffer[64];
+  arpBuildRequest(if_index, ip, mac, buffer);
+  HAL_QueueFrame(if_index, buffer, sizeof(buffer));
+}
+
+// IPv4 packets waiting for their nexthop to be resolved. They are kept as
+// frames with room for the L2 header in front, so that once the nexthop is
+// learned the header is written in place and they are queued as they are.
+// Bounded per nexthop and in total; whatever is not resolved in
+// HAL_ARP_INCOMPLETE_MS is dropped.
+#define HAL_ARP_HOLD_MAX 64
+#define HAL_ARP_HOLD_PER_NEXTHOP 8
+struct HAL_ArpHold {
+  in_addr_t nexthop;
+  uint32_t since;  // when it was held
+  uint16_t length; // of the IPv4 packet, 0 if the slot is free
+  uint8_t if_index;
+  uint8_t frame[HAL_L2_HEADER_MAX + HAL_LEND_SLOT_SIZE];
+};
+
+struct HAL_ArpHoldQueue {
+  struct HAL_ArpHold slots[HAL_ARP_HOLD_MAX];
+  int n_held;
+};
+
+static inline int arpHold(struct HAL_ArpHoldQueue *q, int if_index,
+                          in_addr_t nexthop, const uint8_t *packet,
+                          size_t length, uint32_t now) {
+  if (packet == NULL || length == 0 || length > HAL_LEND_SLOT_SIZE) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  struct HAL_ArpHold *free_slot = NULL;
+  int same = 0;
+  for (int i = 0; i < HAL_ARP_HOLD_MAX; i++) {
+    struct HAL_ArpHold *h = &q->slots[i];
+    if (h->length == 0) {
+      if (!free_slot) {
+        free_slot = h;
+      }
+    } else if (h->nexthop == nexthop && h->if_index == if_index) {
+      same++;
+    }
+  }
+  if (!free_slot || same >= HAL_ARP_HOLD_PER_NEXTHOP) {
+    return HAL_ERR_UNKNOWN;
+  }
+  free_slot->nexthop = nexthop;
+  free_slot->if_index = if_index;
+  free_slot->since = now;
+  free_slot->length = length;
+  memcpy(&free_slot->frame[HAL_L2_HEADER_MAX], packet, length);
+  q->n_held++;
+  return 0;
+}
+
+// put header in front of the held packet and queue it
+static inline void arpHoldSend(struct HAL_ArpHold *h, const uint8_t *header,
+                               int header_len) {
+  uint8_t *frame = &h->frame[HAL_L2_HEADER_MAX - header_len];
+  memcpy(frame, header, header_len);
+  HAL_QueueFrame(h->if_index, frame, header_len + h->length);
+}
+
+// nexthop on if_index was just learned to be at mac: send what waits for it
+static inline void arpHoldFlush(struct HAL_ArpHoldQueue *q, int if_index,
+                                in_addr_t nexthop, macaddr_t mac) {
+  if (q->n_held == 0) {
+    return;
+  }
+  uint8_t header[HAL_L2_HEADER_MAX];
+  int header_len = -1;
+  for (int i = 0; i < HAL_ARP_HOLD_MAX; i++) {
+    struct HAL_ArpHold *h = &q->slots[i];
+    if (h->length == 0 || h->nexthop != nexthop || h->if_index != if_index) {
+      continue;
+    }
+    if (header_len < 0) {
+      header_len = HAL_BuildL2Header(if_index, mac, header);
+    }
+    if (header_len >= 0) {
+      arpHoldSend(h, header, header_len);
+    }
+    h->length = 0;
+    q->n_held--;
+  }
+  if (header_len >= 0) {
+    HAL_FlushSendQueues();
+  }
+}
+
+// the packets of one nexthop taken out of the queue by arpHoldTake
+struct HAL_ArpHeld {
+  int n;
+  struct HAL_ArpHold packets[HAL_ARP_HOLD_PER_NEXTHOP];
+};
+
+// arpHoldFlush in two steps, for a queue shared under a lock: move what
+// waits for nexthop on if_index to out with the lock held, then
+// arpHeldFlush it after the lock is released
+static inline void arpHoldTake(struct HAL_ArpHoldQueue *q, int if_index,
+                               in_addr_t nexthop, struct HAL_ArpHeld *out) {
+  out->n = 0;
+  for (int i = 0; i < HAL_ARP_HOLD_MAX && q->n_held > 0; i++) {
+    struct HAL_ArpHold *h = &q->slots[i];
+    if (h->length == 0 || h->nexthop != nexthop || h->if_index != if_index) {
+      continue;
+    }
+    // arpHold keeps at most HAL_ARP_HOLD_PER_NEXTHOP of them
+    struct HAL_ArpHold *p = &out->packets[out->n++];
+    p->nexthop = h->nexthop;
+    p->since = h->since;
+    p->length = h->length;
+    p->if_index = h->if_index;
+    memcpy(&p->frame[HAL_L2_HEADER_MAX], &h->frame[HAL_L2_HEADER_MAX],
+           h->length);
+    h->length = 0;
+    q->n_held--;
+  }
+}
+
+static inline void arpHeldFlush(struct HAL_ArpHeld *held, macaddr_t mac) {
+  if (held->n == 0) {
+    return;
+  }
+  uint8_t header[HAL_L2_HEADER_MAX];
+  int header_len = HAL_BuildL2Header(held->packets[0].if_index, mac, header);
+  if (header_len < 0) {
+    return;
+  }
+  for (int i = 0; i < held->n; i++) {
+    arpHoldSend(&held->packets[i], header, header_len);
+  }
+  HAL_FlushSendQueues();
+}
+
+// drop packets whose nexthop did not answer in time
+static inline void arpHoldExpire(struct HAL_ArpHoldQueue *q, uint32_t now) {
+  if (q->n_held == 0) {
+    return;
+  }
+  for (int i = 0; i < HAL_ARP_HOLD_MAX; i++) {
+    struct HAL_ArpHold *h = &q->slots[i];
+    if (h->length != 0 && now - h->since >= HAL_ARP_INCOMPLETE_MS) {
+      h->length = 0;
+      q->n_held--;
+    }
+  }
+}
+
 #endif
@@ -0,0 +1,79 @@
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+// A bounded queue between exactly one producer thread and one consumer
+// thread, without locks. Each side has a cache line of its own with its
+// index and a cached copy of the other side's index, and only reads the
+// other side's line when the cached copy says the ring looks full (or
+// empty), so in steady state the two threads do not bounce cache lines.
+// A zero-initialized ring (e.g. a static one) is empty.
+#include <stdint.h>
+
+#define SPSC_CACHE_LINE 64
+
+// N must be a power of two
+template <typename T, uint32_t N> struct SpscRing {
+  // written by the producer
+  alignas(SPSC_CACHE_LINE) uint32_t head; // next item to write
+  uint32_t tail_seen; // the consumer's tail when last read
+  uint64_t drops;     // items the producer could not put in
+  // written by the consumer
+  alignas(SPSC_CACHE_LINE) uint32_t tail; // next item to read
+  uint32_t head_seen;  // the producer's head when last read
+  uint32_t high_water; // most items found waiting at once
+  alignas(SPSC_CACHE_LINE) T items[N];
+};
+
+// producer: false (and counted as a drop) if the ring is full
+template <typename T, uint32_t N>
+static bool spscPush(SpscRing<T, N> &r, const T &item) {
+  static_assert((N & (N - 1)) == 0, "SpscRing size must be a power of two");
+  if (r.head - r.tail_seen == N) {
+    r.tail_seen = __atomic_load_n(&r.tail, __ATOMIC_ACQUIRE);
+    if (r.head - r.tail_seen == N) {
+      __atomic_store_n(&r.drops, r.drops + 1, __ATOMIC_RELAXED);
+      return false;
+    }
+  }
+  r.items[r.head & (N - 1)] = item;
+  __atomic_store_n(&r.head, r.head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// producer: count an item dropped before it got to the ring
+template <typename T, uint32_t N> static void spscDrop(SpscRing<T, N> &r) {
+  __atomic_store_n(&r.drops, r.drops + 1, __ATOMIC_RELAXED);
+}
+
+// consumer: false if the ring is empty
+template <typename T, uint32_t N>
+static bool spscPop(SpscRing<T, N> &r, T *item) {
+  if (r.tail == r.head_seen) {
+    r.head_seen = __atomic_load_n(&r.head, __ATOMIC_ACQUIRE);
+    if (r.tail == r.head_seen) {
+      return false;
+    }
+    // everything the consumer has not seen yet is waiting right now
+    uint32_t depth = r.head_seen - r.tail;
+    if (depth > r.high_water) {
+      __atomic_store_n(&r.high_water, depth, __ATOMIC_RELAXED);
+    }
+  }
+  *item = r.items[r.tail & (N - 1)];
+  __atomic_store_n(&r.tail, r.tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// consumer: whether anything is waiting, without taking it
+template <typename T, uint32_t N> static bool spscEmpty(SpscRing<T, N> &r) {
+  return r.tail == r.head_seen &&
+         r.tail == __atomic_load_n(&r.head, __ATOMIC_ACQUIRE);
+}
+
+// any thread: items waiting, a snapshot
+template <typename T, uint32_t N> static uint32_t spscDepth(SpscRing<T, N> &r) {
+  uint32_t tail = __atomic_load_n(&r.tail, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&r.head, __ATOMIC_ACQUIRE) - tail;
+}
+
+#endif
@@ -4,17 +4,18 @@
 
 #include <ifaddrs.h>
 #include <linux/if_packet.h>
-#include <map>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <pcap.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <time.h>
-#include <utility>
 
 #ifndef HAL_PLATFORM_TESTING
 #include "platform/standard.h"
@@ -22,6 +23,16 @@
 #include "platform/testing.h"
 #endif
 
+#ifdef HAL_RX_RING
+#include "rx_ring.h"
+#endif
+#include "tx_ring.h"
+#ifdef HAL_RX_THREADS
+#include "spsc_ring.h"
+#include <poll.h>
+#include <pthread.h>
+#endif
+
 const int IP_OFFSET = 14;
 
 bool inited = false;
@@ -29,13 +40,132 @@ int debugEnabled = 0;
 in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
 macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
 
+#ifndef HAL_RX_RING
 pcap_t *pcap_in_handles[N_IFACE_ON_BOARD];
+#else
+RxRing rx_rings[N_IFACE_ON_BOARD];
+#endif
 pcap_t *pcap_out_handles[N_IFACE_ON_BOARD];
 
-std::map<std::pair<in_addr_t, int>, macaddr_t> arp_table;
-std::map<std::pair<in_addr_t, int>, uint64_t> arp_timer;
+// capture handles are waited on with epoll instead of being polled
+int epoll_fd = -1;
+int epoll_mask = 0; // interfaces currently registered with epoll_fd
+// HAL_WakeWorker: set for a worker whose receive call should return. The
+// worker is signalled on its event_fd with HAL_RX_THREADS, otherwise on
+// wake_fd, which is in the epoll set
+int wake_pending[HAL_WORKERS_MAX];
+int wake_fd = -1;
+
+// forwarding threads, see HAL_SetWorker: the calling thread's worker picks
+// its own send queues (and with HAL_RX_THREADS its own receive rings)
+int n_workers = 1;
+static thread_local int worker = 0;
+static thread_local int next_port = 0; // where the next receive starts its round robin
+
+// per-interface transmit queue: frames go straight into a PACKET_TX_RING
+// and one send() has the kernel transmit them; without a ring they are
+// copied here and sent with pcap_inject on flush
+const int TX_QUEUE_LEN = 64;
+const int TX_FRAME_MAX = IP_OFFSET + 2048; // fits a TX ring slot
+struct TxQueue {
+  TxRing ring; // ring.fd == -1 to use pcap_inject
+  int len;     // frames waiting in frames[]
+  size_t lengths[TX_QUEUE_LEN];
+  uint8_t frames[TX_QUEUE_LEN][TX_FRAME_MAX];
+};
+TxQueue tx_queues[HAL_WORKERS_MAX][N_IFACE_ON_BOARD];
+
+HAL_ArpCache arp_cache;
+HAL_ArpHoldQueue arp_hold; // packets waiting for ARP
+
+#ifdef HAL_RX_THREADS
+// every interface has a thread that does nothing but capture: it copies
+// frames into slots of its own and passes their indexes to the worker
+// that handles them through an SPSC ring, and the worker passes them back
+// through another once it is done with them. ARP and everything else
+// stays on the workers
+const uint32_t RX_THREAD_SLOTS = 1024; // per interface, also the ring size
+const int RX_THREAD_BATCH = 64;        // frames captured per dispatch
+const size_t RX_THREAD_FRAME_MAX = IP_OFFSET + HAL_LEND_SLOT_SIZE;
+struct RxThread {
+  pthread_t thread;
+  int port;
+  SpscRing<uint32_t, RX_THREAD_SLOTS> ready[HAL_WORKERS_MAX]; // to each worker
+  SpscRing<uint32_t, RX_THREAD_SLOTS> done[HAL_WORKERS_MAX];  // back from each
+  uint32_t free_slots[RX_THREAD_SLOTS]; // slots the RX thread has at hand
+  uint32_t n_free;
+  uint32_t woken; // bitmask of workers given frames by the current dispatch
+  uint32_t lengths[RX_THREAD_SLOTS];
+  // frames start so that the IPv4 packet has HAL_L2_HEADER_MAX bytes in
+  // front of it, like every borrowed packet
+  uint8_t slots[RX_THREAD_SLOTS]
+               [HAL_L2_HEADER_MAX - IP_OFFSET + RX_THREAD_FRAME_MAX];
+};
+RxThread rx_threads[N_IFACE_ON_BOARD];
+
+struct alignas(64) RxWorker {
+  int event_fd; // signalled by RX threads that hand over frames while it sleeps
+  int waiting;  // it is (about to be) asleep
+};
+RxWorker rx_workers[HAL_WORKERS_MAX];
+
+// workers share the ARP cache and the hold queue
+pthread_mutex_t arp_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void arpLock() {
+#ifdef HAL_RX_THREADS
+  pthread_mutex_lock(&arp_lock);
+#endif
+}
+
+static void arpUnlock() {
+#ifdef HAL_RX_THREADS
+  pthread_mutex_unlock(&arp_lock);
+#endif
+}
+
+// probes asked for by arpAge, sent once the ARP lock is released. Only
+// worker 0 ages the cache
+struct ArpProbe {
+  int if_index;
+  in_addr_t ip;
+  macaddr_t mac;
+};
+static ArpProbe arp_probes[HAL_ARP_CACHE_SIZE];
+static int n_arp_probes = 0;
+
+static void collectArpProbe(int if_index, in_addr_t ip, const uint8_t *mac) {
+  ArpProbe &p = arp_probes[n_arp_probes++];
+  p.if_index = if_index;
+  p.ip = ip;
+  memcpy(p.mac, mac, sizeof(macaddr_t));
+}
+
+// capture filter for port: only IPv4 and ARP not sent by ourselves, so
+// everything else is dropped in the kernel before it is copied or wakes
+// us up. handleFrame still checks, the filter is best effort
+static bool compileFilter(pcap_t *handle, int port, struct bpf_program *prog) {
+  char filter[64];
+  const uint8_t *mac = interface_mac[port];
+  snprintf(filter, sizeof(filter),
+           "(ip or arp) and not ether src %02x:%02x:%02x:%02x:%02x:%02x",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  if (pcap_compile(handle, prog, filter, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: pcap_compile failed with %s\n",
+              pcap_geterr(handle));
+    }
+    return false;
+  }
+  return true;
+}
 
 extern "C" {
+#ifdef HAL_RX_THREADS
+static bool rxThreadsStart(); // with the rest of the RX thread code below
+#endif
+
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
   if (inited) {
     return 0;
@@ -61,8 +191,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
         memcpy(interface_mac[i],
                ((struct sockaddr_ll *)ifa->ifa_addr)->sll_addr,
                sizeof(macaddr_t));
-        memcpy(arp_table[std::pair<in_addr_t, int>(if_addrs[i], i)],
-               interface_mac[i], sizeof(macaddr_t));
+        arpAddPermanent(&arp_cache, if_addrs[i], i, interface_mac[i]);
         if (debugEnabled) {
           fprintf(stderr, "HAL_Init: found MAC addr of interface %s\n",
                   interfaces[i]);
@@ -76,10 +205,28 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
   // init pcap handles
   char error_buffer[PCAP_ERRBUF_SIZE];
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
-    pcap_in_handles[i] =
-        pcap_open_live(interfaces[i], BUFSIZ, 1, 1, error_buffer);
+#ifndef HAL_RX_RING
+    // immediate mode: the selectable fd wakes up per packet instead of
+    // when the kernel hands over a full buffer
+    pcap_in_handles[i] = pcap_create(interfaces[i], error_buffer);
+    if (pcap_in_handles[i] &&
+        (pcap_set_snaplen(pcap_in_handles[i], BUFSIZ) != 0 ||
+         pcap_set_promisc(pcap_in_handles[i], 1) != 0 ||
+         pcap_set_immediate_mode(pcap_in_handles[i], 1) != 0 ||
+         pcap_activate(pcap_in_handles[i]) < 0)) {
+      pcap_close(pcap_in_handles[i]);
+      pcap_in_handles[i] = NULL;
+    }
     if (pcap_in_handles[i]) {
       pcap_setnonblock(pcap_in_handles[i], 1, error_buffer);
+      struct bpf_program prog;
+      if (compileFilter(pcap_in_handles[i], i, &prog)) {
+        if (pcap_setfilter(pcap_in_handles[i], &prog) != 0 && debugEnabled) {
+          fprintf(stderr, "HAL_Init: pcap_setfilter failed with %s\n",
+                  pcap_geterr(pcap_in_handles[i]));
+        }
+        pcap_freecode(&prog);
+      }
       if (debugEnabled) {
         fprintf(stderr, "HAL_Init: pcap capture enabled for %s\n",
                 interfaces[i]);
@@ -92,12 +239,77 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
                 interfaces[i]);
       }
     }
+#else
+    if (rxRingOpen(rx_rings[i], interfaces[i])) {
+      // same filter as for pcap, compiled against a dead handle and
+      // attached to the ring socket
+      pcap_t *dead = pcap_open_dead(DLT_EN10MB, RX_RING_FRAME_SIZE);
+      struct bpf_program prog;
+      if (dead && compileFilter(dead, i, &prog)) {
+        if (!rxRingFilter(rx_rings[i], &prog) && debugEnabled) {
+          fprintf(stderr, "HAL_Init: SO_ATTACH_FILTER failed with %s\n",
+                  strerror(errno));
+        }
+        pcap_freecode(&prog);
+      }
+      if (dead) {
+        pcap_close(dead);
+      }
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: TPACKET_V3 ring capture enabled for %s\n",
+                interfaces[i]);
+      }
+    } else if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: ring capture disabled for %s: %s\n",
+              interfaces[i], strerror(errno));
+    }
+#endif
     pcap_out_handles[i] =
         pcap_open_live(interfaces[i], BUFSIZ, 1, 0, error_buffer);
   }
 
+  // transmit rings, one per worker, pcap_out_handles stay as the fallback
+  for (int w = 0; w < n_workers; w++) {
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      TxQueue &q = tx_queues[w][i];
+      q.len = 0;
+      if (!txRingOpen(q.ring, interfaces[i]) && debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: no TX ring for %s (%s), sends fall back to "
+                "pcap_inject\n",
+                interfaces[i], strerror(errno));
+      }
+    }
+  }
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: epoll_create1 failed with %s\n", strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+#ifndef HAL_RX_THREADS
+  wake_fd = eventfd(0, EFD_NONBLOCK);
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  ev.data.u32 = N_IFACE_ON_BOARD; // not a port
+  if (wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: eventfd failed with %s\n", strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+#endif
+
   memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
 
+#ifdef HAL_RX_THREADS
+  if (!rxThreadsStart()) {
+    return HAL_ERR_UNKNOWN;
+  }
+#endif
+
   inited = true;
   // send igmp to join RIP multicast group
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
@@ -134,50 +346,30 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
     return 0;
   }
 
-  // lookup arp table
-  auto it = arp_table.find(std::pair<in_addr_t, int>(ip, if_index));
-  if (it != arp_table.end()) {
-    memcpy(o_mac, it->second, sizeof(macaddr_t));
+  // lookup arp cache
+  uint32_t now = HAL_GetTicks();
+  arpLock();
+  HAL_ArpEntry *entry = arpLookup(&arp_cache, ip, if_index, now);
+  if (entry && arpResolved(entry)) {
+    memcpy(o_mac, entry->mac, sizeof(macaddr_t));
+    arpUnlock();
     return 0;
-  } else if (pcap_out_handles[if_index] &&
-             arp_timer[std::pair<in_addr_t, int>(ip, if_index)] + 1000 <
-                 HAL_GetTicks()) {
+  }
+  // rate limit arp request by 1 req/s
+  bool ask = pcap_out_handles[if_index] &&
+             (entry = arpInsert(&arp_cache, ip, if_index, now)) &&
+             arpRequestDue(entry, now);
+  arpUnlock();
+  if (ask) {
     // not found, send arp request
-    // rate limit arp request by 1 req/s
-    arp_timer[std::pair<in_addr_t, int>(ip, if_index)] = HAL_GetTicks();
     if (debugEnabled) {
       fprintf(
           stderr,
           "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
           inet_ntoa(in_addr{ip}));
     }
-    uint8_t buffer[64] = {0};
-    // dst mac
-    for (int i = 0; i < 6; i++) {
-      buffer[i] = 0xff;
-    }
-    // src mac
-    macaddr_t mac;
-    HAL_GetInterfaceMacAddress(if_index, mac);
-    memcpy(&buffer[6], mac, sizeof(macaddr_t));
-    // ARP
-    buffer[12] = 0x08;
-    buffer[13] = 0x06;
-    // hardware type
-    buffer[15] = 0x01;
-    // protocol type
-    buffer[16] = 0x08;
-    // hardware size
-    buffer[18] = 0x06;
-    // protocol size
-    buffer[19] = 0x04;
-    // opcode
-    buffer[21] = 0x01;
-    // sender
-    memcpy(&buffer[22], mac, sizeof(macaddr_t));
-    memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
-    // target
-    memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+    uint8_t buffer[64];
+    arpBuildRequest(if_index, ip, NULL, buffer);
 
     pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer));
   }
@@ -196,122 +388,583 @@ int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   return 0;
 }
 
+// capture side: libpcap handles, or TPACKET_V3 rings with HAL_RX_RING
+static bool rxOpen(int i) {
+#ifndef HAL_RX_RING
+  return pcap_in_handles[i] != NULL;
+#else
+  return rx_rings[i].fd >= 0;
+#endif
+}
+
+static int rxSelectableFd(int i) {
+#ifndef HAL_RX_RING
+  return pcap_get_selectable_fd(pcap_in_handles[i]);
+#else
+  return rx_rings[i].fd;
+#endif
+}
+
+static int rxDispatch(int i, int cnt, pcap_handler callback, u_char *user) {
+#ifndef HAL_RX_RING
+  return pcap_dispatch(pcap_in_handles[i], cnt, callback, user);
+#else
+  return rxRingDispatch(rx_rings[i], cnt, callback, user);
+#endif
+}
+
+#ifndef HAL_RX_THREADS
+// make epoll_fd watch exactly the capture handles in if_index_mask,
+// so that traffic on other interfaces does not wake us up
+static void epollSetMask(int if_index_mask) {
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    bool want = rxOpen(i) && (if_index_mask & (1 << i));
+    bool have = epoll_mask & (1 << i);
+    if (want == have) {
+      continue;
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    int fd = rxSelectableFd(i);
+    if (epoll_ctl(epoll_fd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) == 0) {
+      epoll_mask ^= 1 << i;
+    } else if (debugEnabled) {
+      fprintf(stderr, "epollSetMask: epoll_ctl failed with %s\n", strerror(errno));
+    }
+  }
+}
+#endif
+
+// look at a captured frame: ARP is learned (and answered) here, returns true
+// for IPv4 frames that should go up to the caller
+static bool handleFrame(int port, const uint8_t *packet, size_t caplen) {
+  if (caplen < IP_OFFSET) {
+    return false;
+  }
+  if (memcmp(&packet[6], interface_mac[port], sizeof(macaddr_t)) == 0) {
+    // skip outbound
+    return false;
+  }
+  if (packet[12] == 0x08 && packet[13] == 0x00) {
+    // IPv4
+    return true;
+  }
+  if (packet[12] == 0x08 && packet[13] == 0x06) {
+    // ARP
+    // learn it
+    macaddr_t mac;
+    memcpy(mac, &packet[22], sizeof(macaddr_t));
+    in_addr_t ip;
+    memcpy(&ip, &packet[28], sizeof(in_addr_t));
+    HAL_ArpHeld held;
+    arpLock();
+    arpLearn(&arp_cache, ip, port, mac, HAL_GetTicks());
+    arpHoldTake(&arp_hold, port, ip, &held);
+    arpUnlock();
+    arpHeldFlush(&held, mac);
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
+              inet_ntoa(in_addr{ip}));
+    }
+
+    in_addr_t dst_ip;
+    memcpy(&dst_ip, &packet[38], sizeof(in_addr_t));
+    // ask me: reply
+    if (dst_ip == interface_addrs[port] && packet[21] == 0x01) {
+      // reply
+      uint8_t buffer[64] = {0};
+      // dst mac
+      memcpy(buffer, &packet[6], sizeof(macaddr_t));
+      // src mac
+      macaddr_t mac;
+      HAL_GetInterfaceMacAddress(port, mac);
+      memcpy(&buffer[6], mac, sizeof(macaddr_t));
+      // ARP
+      buffer[12] = 0x08;
+      buffer[13] = 0x06;
+      // hardware type
+      buffer[15] = 0x01;
+      // protocol type
+      buffer[16] = 0x08;
+      // hardware size
+      buffer[18] = 0x06;
+      // protocol size
+      buffer[19] = 0x04;
+      // opcode
+      buffer[21] = 0x02;
+      // sender
+      memcpy(&buffer[22], mac, sizeof(macaddr_t));
+      memcpy(&buffer[28], &dst_ip, sizeof(in_addr_t));
+      // target
+      memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
+      memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
+
+      pcap_inject(pcap_out_handles[port], buffer, sizeof(buffer));
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
+                inet_ntoa(in_addr{ip}));
+      }
+    }
+    // otherwise: learn and ignore
+  }
+  return false;
+}
+
+// pcap_dispatch callback state: fills packets[n..count) (or borrowed)
+// from one port
+struct DispatchContext {
+  int port;
+  HAL_IPPacket *packets;        // copy frames into these, or
+  HAL_BorrowedPacket *borrowed; // lend them out (HAL_RX_RING, HAL_RX_THREADS)
+  int count;
+  int n;
+};
+
+#ifndef HAL_RX_THREADS
+static void dispatchHandler(u_char *user, const struct pcap_pkthdr *hdr,
+                            const u_char *packet) {
+  DispatchContext *ctx = (DispatchContext *)user;
+  if (ctx->n == ctx->count || !handleFrame(ctx->port, packet, hdr->caplen)) {
+    return;
+  }
+#ifdef HAL_RX_RING
+  if (ctx->borrowed) {
+    if (hdr->caplen < hdr->len) {
+      // truncated by the ring, cannot be sent on as it is
+      return;
+    }
+    HAL_BorrowedPacket &b = ctx->borrowed[ctx->n++];
+    // the ring is mapped writable, and the frame header in front of the
+    // packet is free to be overwritten
+    b.buffer = (uint8_t *)&packet[IP_OFFSET];
+    b.length = hdr->caplen - IP_OFFSET;
+    memcpy(b.dst_mac, &packet[0], sizeof(macaddr_t));
+    memcpy(b.src_mac, &packet[6], sizeof(macaddr_t));
+    b.if_index = ctx->port;
+    b.handle = ctx->port * RX_RING_BLOCK_NR + rxRingHold(rx_rings[ctx->port]);
+    return;
+  }
+#endif
+  HAL_IPPacket &p = ctx->packets[ctx->n++];
+  // TODO: what if len != caplen
+  // Beware: might be larger than MTU because of offloading
+  p.length = hdr->caplen - IP_OFFSET;
+  memcpy(p.buffer, &packet[IP_OFFSET], p.size > p.length ? p.length : p.size);
+  memcpy(p.dst_mac, &packet[0], sizeof(macaddr_t));
+  memcpy(p.src_mac, &packet[6], sizeof(macaddr_t));
+  p.if_index = ctx->port;
+}
+#endif
+
+#ifdef HAL_RX_THREADS
+static uint8_t *rxThreadFrame(RxThread &t, uint32_t slot) {
+  return &t.slots[slot][HAL_L2_HEADER_MAX - IP_OFFSET];
+}
+
+// hash of the flow an IPv4 packet belongs to: addresses, protocol and,
+// unless it is a fragment, TCP/UDP ports
+static uint32_t flowHash(const uint8_t *ip, size_t len) {
+  uint32_t src, dst;
+  memcpy(&src, &ip[12], sizeof(src));
+  memcpy(&dst, &ip[16], sizeof(dst));
+  uint32_t h = src * 0x9e3779b1u ^ dst * 0x85ebca6bu ^ ip[9];
+  size_t ihl = (ip[0] & 0xf) * 4;
+  bool fragment = (ip[6] & 0x3f) != 0 || ip[7] != 0; // MF or an offset
+  if ((ip[9] == 6 || ip[9] == 17) && !fragment && len >= ihl + 4) {
+    uint32_t ports;
+    memcpy(&ports, &ip[ihl], sizeof(ports));
+    h ^= ports * 0xc2b2ae35u;
+  }
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  return h;
+}
+
+// the worker a frame goes to: IPv4 by the hash of its flow, so that a flow
+// stays in order on one worker; ARP and whatever is addressed to the
+// router itself go to worker 0
+static int rxSteer(const uint8_t *frame, size_t caplen) {
+  if (n_workers == 1 || caplen < IP_OFFSET + 20 || frame[12] != 0x08 ||
+      frame[13] != 0x00) {
+    return 0;
+  }
+  const uint8_t *ip = &frame[IP_OFFSET];
+  if (ip[16] >= 224) {
+    // multicast or broadcast
+    return 0;
+  }
+  in_addr_t dst;
+  memcpy(&dst, &ip[16], sizeof(dst));
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (dst == interface_addrs[i]) {
+      return 0;
+    }
+  }
+  return ((uint64_t)flowHash(ip, caplen - IP_OFFSET) * n_workers) >> 32;
+}
+
+// RX thread side of dispatch: copy the frame into a slot and pass it on
+static void rxThreadHandler(u_char *user, const struct pcap_pkthdr *hdr,
+                            const u_char *packet) {
+  RxThread &t = *(RxThread *)user;
+  if (hdr->caplen > RX_THREAD_FRAME_MAX) {
+    // does not fit a slot
+    return;
+  }
+  int w = rxSteer(packet, hdr->caplen);
+  if (t.n_free == 0) {
+    // take back whatever the workers are done with
+    for (int i = 0; i < n_workers; i++) {
+      uint32_t slot;
+      while (spscPop(t.done[i], &slot)) {
+        t.free_slots[t.n_free++] = slot;
+      }
+    }
+    if (t.n_free == 0) {
+      // every slot is queued or lent out: the workers are behind
+      spscDrop(t.ready[w]);
+      return;
+    }
+  }
+  uint32_t slot = t.free_slots[--t.n_free];
+  memcpy(rxThreadFrame(t, slot), packet, hdr->caplen);
+  t.lengths[slot] = hdr->caplen;
+  // cannot fail, there are only as many slots as a ring holds
+  spscPush(t.ready[w], slot);
+  t.woken |= 1u << w;
+}
+
+static void *rxThreadMain(void *arg) {
+  RxThread &t = *(RxThread *)arg;
+  struct pollfd pfd = {rxSelectableFd(t.port), POLLIN, 0};
+  while (true) {
+    int res = rxDispatch(t.port, RX_THREAD_BATCH, rxThreadHandler, (u_char *)&t);
+    if (res > 0) {
+      // pairs with the fence in rxThreadWait: either the worker sees the
+      // frames before it sleeps, or we see that it sleeps
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      for (int w = 0; w < n_workers; w++) {
+        if ((t.woken & (1u << w)) &&
+            __atomic_load_n(&rx_workers[w].waiting, __ATOMIC_RELAXED)) {
+          uint64_t one = 1;
+          write(rx_workers[w].event_fd, &one, sizeof(one));
+        }
+      }
+      t.woken = 0;
+      continue;
+    }
+    if (res < 0) {
+      if (debugEnabled) {
+        fprintf(stderr, "rxThreadMain: capture failed on %s, stopping\n",
+                interfaces[t.port]);
+      }
+      return NULL;
+    }
+    poll(&pfd, 1, -1);
+  }
+}
+
+// worker side: take at most cnt frames of port off its ring, same
+// contract as rxDispatch with dispatchHandler
+static int rxThreadReceive(int port, int cnt, DispatchContext &ctx) {
+  RxThread &t = rx_threads[port];
+  int n = 0;
+  uint32_t slot;
+  while (n < cnt && spscPop(t.ready[worker], &slot)) {
+    n++;
+    uint8_t *frame = rxThreadFrame(t, slot);
+    size_t caplen = t.lengths[slot];
+    if (!handleFrame(port, frame, caplen)) {
+      spscPush(t.done[worker], slot);
+      continue;
+    }
+    if (ctx.borrowed) {
+      HAL_BorrowedPacket &b = ctx.borrowed[ctx.n++];
+      b.buffer = &frame[IP_OFFSET];
+      b.length = caplen - IP_OFFSET;
+      memcpy(b.dst_mac, &frame[0], sizeof(macaddr_t));
+      memcpy(b.src_mac, &frame[6], sizeof(macaddr_t));
+      b.if_index = port;
+      b.handle = port * RX_THREAD_SLOTS + slot;
+      continue;
+    }
+    HAL_IPPacket &p = ctx.packets[ctx.n++];
+    p.length = caplen - IP_OFFSET;
+    memcpy(p.buffer, &frame[IP_OFFSET], p.size > p.length ? p.length : p.size);
+    memcpy(p.dst_mac, &frame[0], sizeof(macaddr_t));
+    memcpy(p.src_mac, &frame[6], sizeof(macaddr_t));
+    p.if_index = port;
+    spscPush(t.done[worker], slot);
+  }
+  return n;
+}
+
+// sleep until an RX thread hands this worker frames from a port in
+// if_index_mask, or for wait ms (-1 for infinity)
+static bool rxThreadWait(int if_index_mask, int wait) {
+  RxWorker &w = rx_workers[worker];
+  // from here on RX threads signal event_fd
+  __atomic_store_n(&w.waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bool ok = true;
+  bool pending = false;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if ((if_index_mask & (1 << i)) && rxOpen(i) &&
+        !spscEmpty(rx_threads[i].ready[worker])) {
+      pending = true;
+    }
+  }
+  if (!pending) {
+    struct pollfd pfd = {w.event_fd, POLLIN, 0};
+    int res = poll(&pfd, 1, wait);
+    ok = res >= 0 || errno == EINTR;
+    if (res > 0) {
+      uint64_t value;
+      read(w.event_fd, &value, sizeof(value));
+    }
+  }
+  __atomic_store_n(&w.waiting, 0, __ATOMIC_RELAXED);
+  return ok;
+}
+
+static bool rxThreadsStart() {
+  for (int w = 0; w < n_workers; w++) {
+    rx_workers[w].event_fd = eventfd(0, EFD_NONBLOCK);
+    if (rx_workers[w].event_fd < 0) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: eventfd failed with %s\n", strerror(errno));
+      }
+      return false;
+    }
+  }
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (!rxOpen(i)) {
+      continue;
+    }
+    RxThread &t = rx_threads[i];
+    t.port = i;
+    for (uint32_t slot = 0; slot < RX_THREAD_SLOTS; slot++) {
+      t.free_slots[slot] = slot;
+    }
+    t.n_free = RX_THREAD_SLOTS;
+    int res = pthread_create(&t.thread, NULL, rxThreadMain, &t);
+    if (res != 0) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: cannot start RX thread for %s: %s\n",
+                interfaces[i], strerror(res));
+      }
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
 int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
                         macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
                         int *if_index) {
-  if (!inited) {
-    return HAL_ERR_CALLED_BEFORE_INIT;
-  }
-  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
-      (timeout < 0 && timeout != -1) || (if_index == NULL) || (buffer == NULL)) {
+  if ((if_index == NULL) || (buffer == NULL)) {
     return HAL_ERR_INVALID_PARAMETER;
   }
+  HAL_IPPacket packet;
+  packet.buffer = buffer;
+  packet.size = length;
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, &packet, 1, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  memcpy(dst_mac, packet.dst_mac, sizeof(macaddr_t));
+  memcpy(src_mac, packet.src_mac, sizeof(macaddr_t));
+  *if_index = packet.if_index;
+  return packet.length;
+}
 
+// common part of HAL_ReceiveIPPacketBatch and HAL_BorrowIPPacketBatch,
+// parameters are already checked
+static int receiveBatch(int if_index_mask, DispatchContext &ctx,
+                        int64_t timeout) {
+  int count = ctx.count;
   bool flag = false;
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
-    if (pcap_in_handles[i] && (if_index_mask & (1 << i))) {
+    if (rxOpen(i) && (if_index_mask & (1 << i))) {
       flag = true;
     }
   }
   if (!flag) {
     if (debugEnabled) {
       fprintf(stderr,
-              "HAL_ReceiveIPPacket: no viable interfaces open for capture\n");
+              "HAL_ReceiveIPPacketBatch: no viable interfaces open for capture\n");
     }
     return HAL_ERR_IFACE_NOT_EXIST;
   }
+#ifndef HAL_RX_THREADS
+  epollSetMask(if_index_mask);
+#endif
 
   int64_t begin = HAL_GetTicks();
-  int64_t current_time = 0;
-  // Round robin
-  int current_port = 0;
-  struct pcap_pkthdr hdr;
-  do {
-    if ((if_index_mask & (1 << current_port)) == 0 ||
-        !pcap_in_handles[current_port]) {
-      current_port = (current_port + 1) % N_IFACE_ON_BOARD;
+  if (worker == 0) {
+    // ARP housekeeping is done by one worker only
+    arpLock();
+    n_arp_probes = 0;
+    arpAge(&arp_cache, begin, collectArpProbe);
+    arpHoldExpire(&arp_hold, begin);
+    arpUnlock();
+    for (int i = 0; i < n_arp_probes; i++) {
+      arpQueueProbe(arp_probes[i].if_index, arp_probes[i].ip,
+                    arp_probes[i].mac);
+    }
+    if (n_arp_probes > 0) {
+      HAL_FlushSendQueues();
+    }
+  }
+  while (true) {
+    // drain what is already buffered, round robin over the ports
+    bool drained = true;
+    for (int k = 0; k < N_IFACE_ON_BOARD && ctx.n < count; k++) {
+      int current_port = next_port;
+      next_port = (next_port + 1) % N_IFACE_ON_BOARD;
+      if ((if_index_mask & (1 << current_port)) == 0 ||
+          !rxOpen(current_port)) {
+        continue;
+      }
+      ctx.port = current_port;
+      // at most one frame per free slot, so no IPv4 frame is ever dropped
+#ifndef HAL_RX_THREADS
+      int res = rxDispatch(current_port, count - ctx.n, dispatchHandler,
+                           (u_char *)&ctx);
+#else
+      int res = rxThreadReceive(current_port, count - ctx.n, ctx);
+#endif
+      if (res > 0) {
+        drained = false;
+      } else if (res < 0 && debugEnabled) {
+        fprintf(stderr, "HAL_ReceiveIPPacketBatch: capture failed on %s\n",
+                interfaces[current_port]);
+      }
+    }
+    if (ctx.n == count || (ctx.n > 0 && drained)) {
+      return ctx.n;
+    }
+    if (!drained) {
       continue;
     }
 
-    const uint8_t *packet = pcap_next(pcap_in_handles[current_port], &hdr);
-    if (packet && hdr.caplen >= IP_OFFSET &&
-        memcmp(&packet[6], interface_mac[current_port], sizeof(macaddr_t)) ==
-            0) {
-      // skip outbound
-      continue;
-    } else if (packet && hdr.caplen >= IP_OFFSET && packet[12] == 0x08 &&
-               packet[13] == 0x00) {
-      // IPv4
-      // TODO: what if len != caplen
-      // Beware: might be larger than MTU because of offloading
-      size_t ip_len = hdr.caplen - IP_OFFSET;
-      size_t real_length = length > ip_len ? ip_len : length;
-      memcpy(buffer, &packet[IP_OFFSET], real_length);
-      memcpy(dst_mac, &packet[0], sizeof(macaddr_t));
-      memcpy(src_mac, &packet[6], sizeof(macaddr_t));
-      *if_index = current_port;
-      return ip_len;
-    } else if (packet && hdr.caplen >= IP_OFFSET && packet[12] == 0x08 &&
-               packet[13] == 0x06) {
-      // ARP
-      // learn it
-      macaddr_t mac;
-      memcpy(mac, &packet[22], sizeof(macaddr_t));
-      in_addr_t ip;
-      memcpy(&ip, &packet[28], sizeof(in_addr_t));
-      memcpy(arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
-             sizeof(macaddr_t));
+    if (__atomic_exchange_n(&wake_pending[worker], 0, __ATOMIC_ACQUIRE)) {
+      // HAL_WakeWorker
+      return 0;
+    }
+    // nothing buffered: sleep until a port has data, time is up or we are
+    // woken up
+    int wait = -1; // -1 for infinity
+    if (timeout != -1) {
+      int64_t remaining = begin + timeout - (int64_t)HAL_GetTicks();
+      if (remaining <= 0) {
+        return 0;
+      }
+      wait = remaining > 0x7FFFFFFF ? 0x7FFFFFFF : (int)remaining;
+    }
+#ifdef HAL_RX_THREADS
+    if (!rxThreadWait(if_index_mask, wait)) {
       if (debugEnabled) {
-        fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
-                inet_ntoa(in_addr{ip}));
+        fprintf(stderr, "HAL_ReceiveIPPacketBatch: poll failed with %s\n",
+                strerror(errno));
       }
-
-      in_addr_t dst_ip;
-      memcpy(&dst_ip, &packet[38], sizeof(in_addr_t));
-      // ask me: reply
-      if (dst_ip == interface_addrs[current_port] && packet[21] == 0x01) {
-        // reply
-        uint8_t buffer[64] = {0};
-        // dst mac
-        memcpy(buffer, &packet[6], sizeof(macaddr_t));
-        // src mac
-        macaddr_t mac;
-        HAL_GetInterfaceMacAddress(current_port, mac);
-        memcpy(&buffer[6], mac, sizeof(macaddr_t));
-        // ARP
-        buffer[12] = 0x08;
-        buffer[13] = 0x06;
-        // hardware type
-        buffer[15] = 0x01;
-        // protocol type
-        buffer[16] = 0x08;
-        // hardware size
-        buffer[18] = 0x06;
-        // protocol size
-        buffer[19] = 0x04;
-        // opcode
-        buffer[21] = 0x02;
-        // sender
-        memcpy(&buffer[22], mac, sizeof(macaddr_t));
-        memcpy(&buffer[28], &dst_ip, sizeof(in_addr_t));
-        // target
-        memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
-        memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
-
-        pcap_inject(pcap_out_handles[current_port], buffer, sizeof(buffer));
-        if (debugEnabled) {
-          fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
-                  inet_ntoa(in_addr{ip}));
-        }
+      return HAL_ERR_UNKNOWN;
+    }
+#else
+    struct epoll_event events[N_IFACE_ON_BOARD + 1];
+    int ready = epoll_wait(epoll_fd, events, N_IFACE_ON_BOARD + 1, wait);
+    if (ready < 0 && errno != EINTR) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_ReceiveIPPacketBatch: epoll_wait failed with %s\n",
+                strerror(errno));
       }
-      // otherwise: learn and ignore
-      continue;
+      return HAL_ERR_UNKNOWN;
     }
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.u32 == N_IFACE_ON_BOARD) {
+        // wake_pending is checked on the next round
+        uint64_t value;
+        read(wake_fd, &value, sizeof(value));
+      }
+    }
+#endif
+  }
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_IPPacket *packets,
+                             int count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1) || (packets == NULL) || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  DispatchContext ctx = {0, packets, NULL, count, 0};
+  return receiveBatch(if_index_mask, ctx, timeout);
+}
 
-    current_port = (current_port + 1) % N_IFACE_ON_BOARD;
-    // -1 for infinity
-  } while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1);
+int HAL_BorrowIPPacketBatch(int if_index_mask, HAL_BorrowedPacket *packets,
+                            int count, int64_t timeout) {
+#if !defined(HAL_RX_RING) && !defined(HAL_RX_THREADS)
+  // libpcap reuses its buffer, packets are copied into the common slots
+  return lendBorrow(if_index_mask, packets, count, timeout);
+#else
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1) || (packets == NULL) || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  DispatchContext ctx = {0, NULL, packets, count, 0};
+  return receiveBatch(if_index_mask, ctx, timeout);
+#endif
+}
+
+int HAL_ReleaseBorrowedPacket(HAL_BorrowedPacket *packet) {
+#ifdef HAL_RX_THREADS
+  if (packet == NULL || packet->buffer == NULL ||
+      packet->handle >= N_IFACE_ON_BOARD * RX_THREAD_SLOTS) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  spscPush(rx_threads[packet->handle / RX_THREAD_SLOTS].done[worker],
+           (uint32_t)(packet->handle % RX_THREAD_SLOTS));
+  packet->buffer = NULL;
+  return 0;
+#elif !defined(HAL_RX_RING)
+  return lendRelease(packet);
+#else
+  if (packet == NULL || packet->buffer == NULL ||
+      packet->handle >= N_IFACE_ON_BOARD * RX_RING_BLOCK_NR) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  rxRingPut(rx_rings[packet->handle / RX_RING_BLOCK_NR],
+            packet->handle % RX_RING_BLOCK_NR);
+  packet->buffer = NULL;
   return 0;
+#endif
+}
+
+int HAL_QueueBorrowedPacket(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len) {
+#if !defined(HAL_RX_RING) && !defined(HAL_RX_THREADS)
+  return lendQueue(if_index, packet, header_len);
+#else
+  if (packet == NULL || packet->buffer == NULL ||
+      header_len > HAL_L2_HEADER_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // straight from the RX ring into the TX ring, the kernel needs its own
+  // copy of a frame on a packet socket anyway
+  int res = HAL_QueueFrame(if_index, packet->buffer - header_len,
+                           header_len + packet->length);
+  HAL_ReleaseBorrowedPacket(packet);
+  return res;
+#endif
 }
 
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
@@ -326,23 +979,284 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
     return HAL_ERR_IFACE_NOT_EXIST;
   }
   uint8_t *eth_buffer = (uint8_t *)malloc(length + IP_OFFSET);
-  memcpy(eth_buffer, dst_mac, sizeof(macaddr_t));
-  memcpy(&eth_buffer[6], interface_mac[if_index], sizeof(macaddr_t));
-  // IPv4
-  eth_buffer[12] = 0x08;
-  eth_buffer[13] = 0x00;
+  HAL_BuildL2Header(if_index, dst_mac, eth_buffer);
   memcpy(&eth_buffer[IP_OFFSET], buffer, length);
-  if (pcap_inject(pcap_out_handles[if_index], eth_buffer, length + IP_OFFSET) >=
-      0) {
-    free(eth_buffer);
+  int res = HAL_SendFrame(if_index, eth_buffer, length + IP_OFFSET);
+  free(eth_buffer);
+  return res;
+}
+
+int HAL_SendIPPacketInPlace(int if_index, uint8_t *buffer, size_t length,
+                            macaddr_t dst_mac) {
+  // the caller left room for the header right in front of the packet
+  uint8_t *frame = buffer - IP_OFFSET;
+  int res = HAL_BuildL2Header(if_index, dst_mac, frame);
+  if (res < 0) {
+    return res;
+  }
+  return HAL_SendFrame(if_index, frame, length + IP_OFFSET);
+}
+
+uint32_t HAL_GetArpVersion() {
+  return __atomic_load_n(&arp_cache.version, __ATOMIC_ACQUIRE);
+}
+
+int HAL_GetRxQueueStats(int if_index, HAL_RxQueueStats *stats) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || stats == NULL) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+#ifdef HAL_RX_THREADS
+  if (!rxOpen(if_index)) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  // the rings of all workers together
+  stats->size = RX_THREAD_SLOTS;
+  stats->depth = 0;
+  stats->high_water = 0;
+  stats->drops = 0;
+  for (int w = 0; w < n_workers; w++) {
+    SpscRing<uint32_t, RX_THREAD_SLOTS> &ring = rx_threads[if_index].ready[w];
+    uint32_t high_water = __atomic_load_n(&ring.high_water, __ATOMIC_RELAXED);
+    stats->depth += spscDepth(ring);
+    stats->high_water = high_water > stats->high_water ? high_water : stats->high_water;
+    stats->drops += __atomic_load_n(&ring.drops, __ATOMIC_RELAXED);
+  }
+  return 0;
+#else
+  return HAL_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int HAL_HoldIPPacket(int if_index, in_addr_t nexthop, const uint8_t *buffer,
+                     size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  arpLock();
+  int res = arpHold(&arp_hold, if_index, nexthop, buffer, length, HAL_GetTicks());
+  arpUnlock();
+  return res;
+}
+
+int HAL_SetWorkerCount(int count) {
+  if (inited || count < 1 || count > HAL_WORKERS_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+#ifndef HAL_RX_THREADS
+  if (count > 1) {
+    // frames are received on the calling thread, there is nothing to steer
+    return HAL_ERR_NOT_SUPPORTED;
+  }
+#endif
+  n_workers = count;
+  return 0;
+}
+
+int HAL_SetWorker(int w) {
+  if (w < 0 || w >= n_workers) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  worker = w;
+  return 0;
+}
+
+int HAL_WakeWorker(int w) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (w < 0 || w >= n_workers) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  __atomic_store_n(&wake_pending[w], 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+#ifdef HAL_RX_THREADS
+  write(rx_workers[w].event_fd, &one, sizeof(one));
+#else
+  write(wake_fd, &one, sizeof(one));
+#endif
+  return 0;
+}
+
+int HAL_BuildL2Header(int if_index, macaddr_t dst_mac, uint8_t *header) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+  return IP_OFFSET;
+}
+
+int HAL_SendFrame(int if_index, uint8_t *frame, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (!pcap_out_handles[if_index]) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  TxRing &ring = tx_queues[worker][if_index].ring;
+  if (ring.fd >= 0 && length <= TX_RING_DATA_MAX) {
+    uint8_t *slot = txRingAlloc(ring);
+    if (slot) {
+      memcpy(slot, frame, length);
+      txRingCommit(ring, length);
+      if (txRingKick(ring) == 0) {
+        return 0;
+      }
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_SendFrame: TX ring send failed with %s\n",
+                strerror(errno));
+      }
+      return HAL_ERR_UNKNOWN;
+    }
+  }
+  if (ring.fd >= 0 && ring.pending > 0) {
+    // keep the order of frames already in the ring
+    txRingKick(ring);
+  }
+  if (pcap_inject(pcap_out_handles[if_index], frame, length) >= 0) {
     return 0;
   } else {
     if (debugEnabled) {
-      fprintf(stderr, "HAL_SendIPPacket: pcap_inject failed with %s\n",
+      fprintf(stderr, "HAL_SendFrame: pcap_inject failed with %s\n",
               pcap_geterr(pcap_out_handles[if_index]));
     }
-    free(eth_buffer);
     return HAL_ERR_UNKNOWN;
   }
 }
-}
\ No newline at end of file
+
+// send everything queued on one interface
+static int flushQueue(int if_index) {
+  TxQueue &q = tx_queues[worker][if_index];
+  if (q.ring.fd >= 0) {
+    if (txRingKick(q.ring) == 0) {
+      return 0;
+    }
+    if (debugEnabled) {
+      fprintf(stderr, "flushQueue: TX ring send failed with %s\n",
+              strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+  int res = 0;
+  for (int i = 0; i < q.len; i++) {
+    if (pcap_inject(pcap_out_handles[if_index], q.frames[i], q.lengths[i]) < 0) {
+      res = HAL_ERR_UNKNOWN;
+    }
+  }
+  q.len = 0;
+  return res;
+}
+
+// next free slot of the queue, flushing it first if needed; NULL if the
+// ring is still full after that
+static uint8_t *queueSlot(int if_index, int *res) {
+  TxQueue &q = tx_queues[worker][if_index];
+  if (q.ring.fd >= 0) {
+    if (q.ring.pending == TX_QUEUE_LEN && flushQueue(if_index) != 0) {
+      *res = HAL_ERR_UNKNOWN;
+    }
+    return txRingAlloc(q.ring);
+  }
+  if (q.len == TX_QUEUE_LEN && flushQueue(if_index) != 0) {
+    *res = HAL_ERR_UNKNOWN;
+  }
+  return q.frames[q.len];
+}
+
+static void queueCommit(int if_index, size_t length) {
+  TxQueue &q = tx_queues[worker][if_index];
+  if (q.ring.fd >= 0) {
+    txRingCommit(q.ring, length);
+  } else {
+    q.lengths[q.len++] = length;
+  }
+}
+
+int HAL_SendIPPacketBatch(int if_index, HAL_IPPacket *packets, int count) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || packets == NULL ||
+      count < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (!pcap_out_handles[if_index]) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  int res = 0;
+  for (int i = 0; i < count; i++) {
+    HAL_IPPacket &p = packets[i];
+    if (p.length > TX_FRAME_MAX - IP_OFFSET) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+    // build the frame right in the queue slot
+    uint8_t *frame = queueSlot(if_index, &res);
+    if (!frame) {
+      // the kernel is behind, drop it
+      res = HAL_ERR_QUEUE_FULL;
+      continue;
+    }
+    HAL_BuildL2Header(if_index, p.dst_mac, frame);
+    memcpy(&frame[IP_OFFSET], p.buffer, p.length);
+    queueCommit(if_index, IP_OFFSET + p.length);
+  }
+  if (flushQueue(if_index) != 0) {
+    res = HAL_ERR_UNKNOWN;
+  }
+  return res;
+}
+
+int HAL_QueueFrame(int if_index, uint8_t *frame, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (!pcap_out_handles[if_index]) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  if (length > TX_FRAME_MAX) {
+    // does not fit a slot, send it on its own
+    return HAL_SendFrame(if_index, frame, length);
+  }
+  int res = 0;
+  uint8_t *slot = queueSlot(if_index, &res);
+  if (!slot) {
+    // the kernel is behind, drop it
+    return HAL_ERR_QUEUE_FULL;
+  }
+  memcpy(slot, frame, length);
+  queueCommit(if_index, length);
+  return res;
+}
+
+int HAL_FlushSendQueues() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  int res = 0;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    TxQueue &q = tx_queues[worker][i];
+    if ((q.ring.fd >= 0 ? q.ring.pending : q.len) > 0 && flushQueue(i) != 0) {
+      res = HAL_ERR_UNKNOWN;
+    }
+  }
+  return res;
+}
+}
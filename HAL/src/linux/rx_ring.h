@@ -0,0 +1,169 @@
+#ifndef __HAL_LINUX_RX_RING_H__
+#define __HAL_LINUX_RX_RING_H__
+
+// TPACKET_V3 receive ring on an AF_PACKET socket, used instead of libpcap
+// capture when HAL_RX_RING is defined. Frames are read in place from the
+// mmap'ed ring, and a block goes back to the kernel as a whole once every
+// frame in it has been handed out and every frame lent out of it (see
+// rxRingHold) has come back. Until then the reader stops in front of it,
+// as it does in front of a block the kernel still owns.
+#include <assert.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const unsigned RX_RING_BLOCK_SIZE = 1 << 18; // 256 KiB, a multiple of the page size
+const unsigned RX_RING_BLOCK_NR = 64;
+const unsigned RX_RING_FRAME_SIZE = 2048;
+// a block that is not full is handed to us after this long (ms); this bounds
+// the extra latency at low packet rates
+const unsigned RX_RING_BLOCK_TIMEOUT = 1;
+
+struct RxRing {
+  int fd; // -1 if not open
+  uint8_t *map;
+  unsigned block;             // block being read
+  struct tpacket3_hdr *frame; // next frame in it, NULL before the block is started
+  unsigned frames_left;
+  // per block: lent frames plus one while it is being read; the block goes
+  // back to the kernel when this drops to zero
+  unsigned holds[RX_RING_BLOCK_NR];
+};
+
+static struct tpacket_block_desc *rxRingBlock(RxRing &r, unsigned i) {
+  return (struct tpacket_block_desc *)(r.map + (size_t)i * RX_RING_BLOCK_SIZE);
+}
+
+// returns false and leaves r.fd == -1 on failure, errno tells why
+static bool rxRingOpen(RxRing &r, const char *ifname) {
+  r.fd = -1;
+  r.map = NULL;
+  r.block = 0;
+  r.frame = NULL;
+  r.frames_left = 0;
+  memset(r.holds, 0, sizeof(r.holds));
+
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    return false;
+  }
+  int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd < 0) {
+    return false;
+  }
+  int version = TPACKET_V3;
+  struct tpacket_req3 req = {0};
+  req.tp_block_size = RX_RING_BLOCK_SIZE;
+  req.tp_block_nr = RX_RING_BLOCK_NR;
+  req.tp_frame_size = RX_RING_FRAME_SIZE;
+  req.tp_frame_nr = RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE * RX_RING_BLOCK_NR;
+  req.tp_retire_blk_tov = RX_RING_BLOCK_TIMEOUT;
+  size_t size = (size_t)RX_RING_BLOCK_SIZE * RX_RING_BLOCK_NR;
+  struct sockaddr_ll sll = {0};
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  struct packet_mreq mreq = {0};
+  mreq.mr_ifindex = ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  void *map = MAP_FAILED;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0 ||
+      (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+      setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+      bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    if (map != MAP_FAILED) {
+      munmap(map, size);
+    }
+    close(fd);
+    return false;
+  }
+#ifdef PACKET_IGNORE_OUTGOING
+  // our own transmissions would only be skipped later, best effort
+  int one = 1;
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+  r.fd = fd;
+  r.map = (uint8_t *)map;
+  return true;
+}
+
+// have the kernel drop frames the classic BPF program rejects before they
+// take up room in the ring
+static bool rxRingFilter(RxRing &r, const struct bpf_program *prog) {
+  // struct bpf_insn from pcap has the layout of struct sock_filter
+  struct sock_fprog fprog;
+  fprog.len = prog->bf_len;
+  fprog.filter = (struct sock_filter *)prog->bf_insns;
+  return setsockopt(r.fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == 0;
+}
+
+// drop a hold on block i
+static void rxRingPut(RxRing &r, unsigned i) {
+  assert(r.holds[i] > 0);
+  if (--r.holds[i] == 0) {
+    __atomic_store_n(&rxRingBlock(r, i)->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+  }
+}
+
+#ifndef HAL_RX_THREADS
+// called from the rxRingDispatch callback: keeps the frame being handed
+// out in the ring after the callback returns. Returns the handle to give
+// to rxRingPut once the frame is no longer needed
+static unsigned rxRingHold(RxRing &r) {
+  r.holds[r.block]++;
+  return r.block;
+}
+#endif
+
+// same contract as pcap_dispatch on a nonblocking handle: hands at most cnt
+// frames to callback and returns how many, 0 if the ring is empty
+static int rxRingDispatch(RxRing &r, int cnt, pcap_handler callback, u_char *user) {
+  int n = 0;
+  while (n < cnt) {
+    struct tpacket_block_desc *bd = rxRingBlock(r, r.block);
+    if (!r.frame) {
+      if (r.holds[r.block] != 0) {
+        // we are a whole ring ahead of a borrower: the block is still ours
+        // (TP_STATUS_USER) but its frames are lent out and were read already
+        break;
+      }
+      if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+           TP_STATUS_USER) == 0) {
+        break; // still owned by the kernel
+      }
+      r.frames_left = bd->hdr.bh1.num_pkts;
+      r.holds[r.block] = 1;
+      r.frame = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    }
+    while (r.frames_left > 0 && n < cnt) {
+      struct tpacket3_hdr *frame = r.frame;
+      struct pcap_pkthdr hdr;
+      hdr.ts.tv_sec = frame->tp_sec;
+      hdr.ts.tv_usec = frame->tp_nsec / 1000;
+      hdr.caplen = frame->tp_snaplen;
+      hdr.len = frame->tp_len;
+      callback(user, &hdr, (const u_char *)frame + frame->tp_mac);
+      r.frame = (struct tpacket3_hdr *)((uint8_t *)frame + frame->tp_next_offset);
+      r.frames_left--;
+      n++;
+    }
+    if (r.frames_left == 0) {
+      // the whole block has been read, give it back unless frames are lent
+      rxRingPut(r, r.block);
+      r.block = (r.block + 1) % RX_RING_BLOCK_NR;
+      r.frame = NULL;
+    }
+  }
+  return n;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef __HAL_LINUX_TX_RING_H__
+#define __HAL_LINUX_TX_RING_H__
+
+// PACKET_TX_RING (TPACKET_V2) on an AF_PACKET socket: frames are written
+// straight into the mmap'ed ring, marked as ready, and a single send() has
+// the kernel transmit everything that is ready.
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const unsigned TX_RING_BLOCK_SIZE = 1 << 16;
+const unsigned TX_RING_BLOCK_NR = 32;
+const unsigned TX_RING_FRAME_SIZE = 4096; // holds any TX_FRAME_MAX frame
+const unsigned TX_RING_FRAME_NR = TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE * TX_RING_BLOCK_NR;
+// frame data starts after the aligned slot header
+const size_t TX_RING_DATA_OFFSET = TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+const size_t TX_RING_DATA_MAX = TX_RING_FRAME_SIZE - TX_RING_DATA_OFFSET;
+
+struct TxRing {
+  int fd; // -1 if not open
+  uint8_t *map;
+  unsigned head;    // next slot to fill
+  unsigned pending; // slots filled since the last kick
+};
+
+static struct tpacket2_hdr *txRingSlot(TxRing &r, unsigned i) {
+  return (struct tpacket2_hdr *)(r.map + (size_t)i * TX_RING_FRAME_SIZE);
+}
+
+// returns false and leaves r.fd == -1 on failure, errno tells why
+static bool txRingOpen(TxRing &r, const char *ifname) {
+  r.fd = -1;
+  r.map = NULL;
+  r.head = 0;
+  r.pending = 0;
+
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    return false;
+  }
+  // protocol 0: the socket never receives anything
+  int fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int version = TPACKET_V2;
+  struct tpacket_req req = {0};
+  req.tp_block_size = TX_RING_BLOCK_SIZE;
+  req.tp_block_nr = TX_RING_BLOCK_NR;
+  req.tp_frame_size = TX_RING_FRAME_SIZE;
+  req.tp_frame_nr = TX_RING_FRAME_NR;
+  size_t size = (size_t)TX_RING_BLOCK_SIZE * TX_RING_BLOCK_NR;
+  struct sockaddr_ll sll = {0};
+  sll.sll_family = AF_PACKET;
+  sll.sll_ifindex = ifindex;
+  // skip a malformed frame instead of stalling the ring on it
+  int loss = 1;
+  void *map = MAP_FAILED;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0 ||
+      (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+      bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    if (map != MAP_FAILED) {
+      munmap(map, size);
+    }
+    close(fd);
+    return false;
+  }
+  r.fd = fd;
+  r.map = (uint8_t *)map;
+  return true;
+}
+
+// have the kernel send every frame committed so far
+static int txRingKick(TxRing &r) {
+  r.pending = 0;
+  if (send(r.fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+    return -1;
+  }
+  return 0;
+}
+
+// data area of the next free slot, at least TX_RING_DATA_MAX bytes, or NULL
+// if the kernel has not sent the frames in front of it yet
+static uint8_t *txRingAlloc(TxRing &r) {
+  struct tpacket2_hdr *hdr = txRingSlot(r, r.head);
+  uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+  if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+    // full: wait for the kernel to catch up once
+    txRingKick(r);
+    send(r.fd, NULL, 0, 0);
+    status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+    if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+      return NULL;
+    }
+  }
+  return (uint8_t *)hdr + TX_RING_DATA_OFFSET;
+}
+
+// queue the slot returned by the last txRingAlloc, it goes out on the next kick
+static void txRingCommit(TxRing &r, size_t length) {
+  struct tpacket2_hdr *hdr = txRingSlot(r, r.head);
+  hdr->tp_len = length;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+  r.head = (r.head + 1) % TX_RING_FRAME_NR;
+  r.pending++;
+}
+
+#endif
@@ -3,7 +3,6 @@
 #include <stdio.h>
 
 #include <ifaddrs.h>
-#include <map>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <net/if_dl.h>
@@ -16,7 +15,6 @@
 #include <sys/sysctl.h>
 #include <sys/types.h>
 #include <time.h>
-#include <utility>
 
 const int IP_OFFSET = 14;
 
@@ -35,13 +33,31 @@ macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
 pcap_t *pcap_in_handles[N_IFACE_ON_BOARD];
 pcap_t *pcap_out_handles[N_IFACE_ON_BOARD];
 
-// workaround for clang
-struct macaddr_wrap {
-  macaddr_t mac;
-};
-
-std::map<std::pair<in_addr_t, int>, macaddr_wrap> arp_table;
-std::map<std::pair<in_addr_t, int>, uint64_t> arp_timer;
+HAL_ArpCache arp_cache;
+HAL_ArpHoldQueue arp_hold; // packets waiting for ARP
+
+// capture filter for port: only IPv4 and ARP not sent by ourselves, so
+// the rest is dropped by BPF in the kernel before it is copied to us
+static void setFilter(pcap_t *handle, int port) {
+  char filter[64];
+  const uint8_t *mac = interface_mac[port];
+  snprintf(filter, sizeof(filter),
+           "(ip or arp) and not ether src %02x:%02x:%02x:%02x:%02x:%02x",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  struct bpf_program prog;
+  if (pcap_compile(handle, &prog, filter, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: pcap_compile failed with %s\n",
+              pcap_geterr(handle));
+    }
+    return;
+  }
+  if (pcap_setfilter(handle, &prog) != 0 && debugEnabled) {
+    fprintf(stderr, "HAL_Init: pcap_setfilter failed with %s\n",
+            pcap_geterr(handle));
+  }
+  pcap_freecode(&prog);
+}
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -110,8 +126,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
     caddr_t mac = LLADDR(sdl);
     // found
     memcpy(interface_mac[i], mac, sizeof(macaddr_t));
-    memcpy(&arp_table[std::pair<in_addr_t, int>(if_addrs[i], i)],
-           interface_mac[i], sizeof(macaddr_t));
+    arpAddPermanent(&arp_cache, if_addrs[i], i, interface_mac[i]);
     if (debugEnabled) {
       macaddr_t m;
       // handle signedness
@@ -129,6 +144,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
         pcap_open_live(interfaces[i], BUFSIZ, 1, 1, error_buffer);
     if (pcap_in_handles[i]) {
       pcap_setnonblock(pcap_in_handles[i], 1, error_buffer);
+      setFilter(pcap_in_handles[i], i);
       if (debugEnabled) {
         fprintf(stderr, "HAL_Init: pcap capture enabled for %s\n",
                 interfaces[i]);
@@ -180,14 +196,14 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
     return 0;
   }
 
-  auto it = arp_table.find(std::pair<in_addr_t, int>(ip, if_index));
-  if (it != arp_table.end()) {
-    memcpy(o_mac, &it->second, sizeof(macaddr_t));
+  uint32_t now = HAL_GetTicks();
+  HAL_ArpEntry *entry = arpLookup(&arp_cache, ip, if_index, now);
+  if (entry && arpResolved(entry)) {
+    memcpy(o_mac, entry->mac, sizeof(macaddr_t));
     return 0;
   } else if (pcap_out_handles[if_index] &&
-             arp_timer[std::pair<in_addr_t, int>(ip, if_index)] + 1000 <
-                 HAL_GetTicks()) {
-    arp_timer[std::pair<in_addr_t, int>(ip, if_index)] = HAL_GetTicks();
+             (entry = arpInsert(&arp_cache, ip, if_index, now)) &&
+             arpRequestDue(entry, now)) {
     if (debugEnabled) {
       struct in_addr addr;
       addr.s_addr = ip;
@@ -196,33 +212,8 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
           "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
           inet_ntoa(addr));
     }
-    uint8_t buffer[64] = {0};
-    // dst mac
-    for (int i = 0; i < 6; i++) {
-      buffer[i] = 0xff;
-    }
-    // src mac
-    macaddr_t mac;
-    HAL_GetInterfaceMacAddress(if_index, mac);
-    memcpy(&buffer[6], mac, sizeof(macaddr_t));
-    // ARP
-    buffer[12] = 0x08;
-    buffer[13] = 0x06;
-    // hardware type
-    buffer[15] = 0x01;
-    // protocol type
-    buffer[16] = 0x08;
-    // hardware size
-    buffer[18] = 0x06;
-    // protocol size
-    buffer[19] = 0x04;
-    // opcode
-    buffer[21] = 0x01;
-    // sender
-    memcpy(&buffer[22], mac, sizeof(macaddr_t));
-    memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
-    // target
-    memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+    uint8_t buffer[64];
+    arpBuildRequest(if_index, ip, NULL, buffer);
 
     pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer));
   }
@@ -268,6 +259,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
 
   int64_t begin = HAL_GetTicks();
   int64_t current_time = 0;
+  if (arpAge(&arp_cache, begin, arpQueueProbe) > 0) {
+    HAL_FlushSendQueues();
+  }
+  arpHoldExpire(&arp_hold, begin);
   // Round robin
   int current_port = 0;
   struct pcap_pkthdr hdr;
@@ -302,8 +297,8 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
       memcpy(mac, &packet[22], sizeof(macaddr_t));
       in_addr_t ip;
       memcpy(&ip, &packet[28], sizeof(in_addr_t));
-      memcpy(&arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
-             sizeof(macaddr_t));
+      arpLearn(&arp_cache, ip, current_port, mac, HAL_GetTicks());
+      arpHoldFlush(&arp_hold, current_port, ip, mac);
       if (debugEnabled) {
         struct in_addr addr;
         addr.s_addr = ip;
@@ -359,6 +354,32 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
   return 0;
 }
 
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_IPPacket *packets,
+                             int count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int n = 0;
+  while (n < count) {
+    HAL_IPPacket &p = packets[n];
+    // only the first packet may wait, the rest take what is already there
+    int res = HAL_ReceiveIPPacket(if_index_mask, p.buffer, p.size, p.src_mac,
+                                  p.dst_mac, n == 0 ? timeout : 0, &p.if_index);
+    if (res < 0) {
+      // errors (and EOF) are reported by the next call
+      return n > 0 ? n : res;
+    } else if (res == 0) {
+      break;
+    }
+    p.length = res;
+    n++;
+  }
+  return n;
+}
+
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac) {
   if (!inited) {
@@ -371,23 +392,132 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
     return HAL_ERR_IFACE_NOT_EXIST;
   }
   uint8_t *eth_buffer = (uint8_t *)malloc(length + IP_OFFSET);
-  memcpy(eth_buffer, dst_mac, sizeof(macaddr_t));
-  memcpy(&eth_buffer[6], interface_mac[if_index], sizeof(macaddr_t));
-  // IPv4
-  eth_buffer[12] = 0x08;
-  eth_buffer[13] = 0x00;
+  HAL_BuildL2Header(if_index, dst_mac, eth_buffer);
   memcpy(&eth_buffer[IP_OFFSET], buffer, length);
-  if (pcap_inject(pcap_out_handles[if_index], eth_buffer, length + IP_OFFSET) >=
-      0) {
-    free(eth_buffer);
+  int res = HAL_SendFrame(if_index, eth_buffer, length + IP_OFFSET);
+  free(eth_buffer);
+  return res;
+}
+
+int HAL_SendIPPacketInPlace(int if_index, uint8_t *buffer, size_t length,
+                            macaddr_t dst_mac) {
+  // the caller left room for the header right in front of the packet
+  uint8_t *frame = buffer - IP_OFFSET;
+  int res = HAL_BuildL2Header(if_index, dst_mac, frame);
+  if (res < 0) {
+    return res;
+  }
+  return HAL_SendFrame(if_index, frame, length + IP_OFFSET);
+}
+
+uint32_t HAL_GetArpVersion() { return arp_cache.version; }
+
+int HAL_HoldIPPacket(int if_index, in_addr_t nexthop, const uint8_t *buffer,
+                     size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return arpHold(&arp_hold, if_index, nexthop, buffer, length, HAL_GetTicks());
+}
+
+int HAL_BuildL2Header(int if_index, macaddr_t dst_mac, uint8_t *header) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+  return IP_OFFSET;
+}
+
+int HAL_SendFrame(int if_index, uint8_t *frame, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (!pcap_out_handles[if_index]) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  if (pcap_inject(pcap_out_handles[if_index], frame, length) >= 0) {
     return 0;
   } else {
     if (debugEnabled) {
-      fprintf(stderr, "HAL_SendIPPacket: pcap_inject failed with %s\n",
+      fprintf(stderr, "HAL_SendFrame: pcap_inject failed with %s\n",
               pcap_geterr(pcap_out_handles[if_index]));
     }
-    free(eth_buffer);
     return HAL_ERR_UNKNOWN;
   }
 }
-}
\ No newline at end of file
+// no transmit queue here: frames go out as soon as they are queued
+int HAL_SendIPPacketBatch(int if_index, HAL_IPPacket *packets, int count) {
+  if (packets == NULL || count < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (int i = 0; i < count; i++) {
+    int res = HAL_SendIPPacket(if_index, packets[i].buffer, packets[i].length,
+                               packets[i].dst_mac);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+int HAL_QueueFrame(int if_index, uint8_t *frame, size_t length) {
+  return HAL_SendFrame(if_index, frame, length);
+}
+
+int HAL_FlushSendQueues() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return 0;
+}
+
+// pcap buffers only live until the next capture, packets are copied into
+// the common slots
+int HAL_BorrowIPPacketBatch(int if_index_mask, HAL_BorrowedPacket *packets,
+                            int count, int64_t timeout) {
+  return lendBorrow(if_index_mask, packets, count, timeout);
+}
+
+int HAL_QueueBorrowedPacket(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len) {
+  return lendQueue(if_index, packet, header_len);
+}
+
+int HAL_ReleaseBorrowedPacket(HAL_BorrowedPacket *packet) {
+  return lendRelease(packet);
+}
+
+// frames are received on the calling thread, there is no queue
+int HAL_GetRxQueueStats(int if_index, HAL_RxQueueStats *stats) {
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+// a single worker: frames are received on the calling thread
+int HAL_SetWorkerCount(int count) {
+  if (count < 1 || count > HAL_WORKERS_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return count == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_SetWorker(int worker) {
+  return worker == 0 ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_WakeWorker(int worker) {
+  return worker == 0 ? HAL_ERR_NOT_SUPPORTED : HAL_ERR_INVALID_PARAMETER;
+}
+}
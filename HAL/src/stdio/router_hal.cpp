@@ -1,12 +1,11 @@
 #include "router_hal.h"
+#include "router_hal_common.h"
 #include <stdio.h>
 
-#include <map>
 #include <pcap.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <utility>
 
 const int IP_OFFSET = 18; // 6 + 6 + 4 + 2
 
@@ -23,12 +22,8 @@ pcap_t *pcap_handle;
 pcap_t *pcap_out_handle;
 pcap_dumper_t *pcap_dumper;
 
-// workaround for clang
-struct macaddr_wrap {
-  macaddr_t mac;
-};
-
-std::map<std::pair<in_addr_t, int>, macaddr_wrap> arp_table;
+HAL_ArpCache arp_cache;
+HAL_ArpHoldQueue arp_hold; // packets waiting for ARP
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -41,8 +36,7 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
     // hard coded MAC
     macaddr_t mac = {2, 3, 3, 0, 0, (uint8_t)i};
     memcpy(interface_mac[i], mac, sizeof(macaddr_t));
-    memcpy(&arp_table[std::pair<in_addr_t, int>(if_addrs[i], i)],
-           interface_mac[i], sizeof(macaddr_t));
+    arpAddPermanent(&arp_cache, if_addrs[i], i, interface_mac[i]);
   }
 
   char error_buffer[PCAP_ERRBUF_SIZE];
@@ -82,9 +76,10 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
     return 0;
   }
 
-  auto it = arp_table.find(std::pair<in_addr_t, int>(ip, if_index));
-  if (it != arp_table.end()) {
-    memcpy(o_mac, &it->second, sizeof(macaddr_t));
+  // no rate limit here, every miss is visible in the output
+  HAL_ArpEntry *entry = arpLookup(&arp_cache, ip, if_index, HAL_GetTicks());
+  if (entry && arpResolved(entry)) {
+    memcpy(o_mac, entry->mac, sizeof(macaddr_t));
     return 0;
   } else {
     if (debugEnabled) {
@@ -172,6 +167,8 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
 
   int64_t begin = HAL_GetTicks();
   int64_t current_time = 0;
+  arpAge(&arp_cache, begin, NULL);
+  arpHoldExpire(&arp_hold, begin);
 
   struct pcap_pkthdr *hdr;
   const u_char *packet;
@@ -206,8 +203,8 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         in_addr_t ip;
         memcpy(&ip, &packet[32], sizeof(in_addr_t));
 
-        memcpy(&arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
-               sizeof(macaddr_t));
+        arpLearn(&arp_cache, ip, current_port, mac, HAL_GetTicks());
+        arpHoldFlush(&arp_hold, current_port, ip, mac);
         if (debugEnabled) {
           struct in_addr addr;
           addr.s_addr = ip;
@@ -283,6 +280,32 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
   return 0;
 }
 
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_IPPacket *packets,
+                             int count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packets == NULL || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  int n = 0;
+  while (n < count) {
+    HAL_IPPacket &p = packets[n];
+    // only the first packet may wait, the rest take what is already there
+    int res = HAL_ReceiveIPPacket(if_index_mask, p.buffer, p.size, p.src_mac,
+                                  p.dst_mac, n == 0 ? timeout : 0, &p.if_index);
+    if (res < 0) {
+      // errors (and EOF) are reported by the next call
+      return n > 0 ? n : res;
+    } else if (res == 0) {
+      break;
+    }
+    p.length = res;
+    n++;
+  }
+  return n;
+}
+
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac) {
   if (!inited) {
@@ -292,19 +315,66 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
     return HAL_ERR_INVALID_PARAMETER;
   }
   uint8_t *eth_buffer = (uint8_t *)malloc(length + IP_OFFSET);
-  memcpy(eth_buffer, dst_mac, sizeof(macaddr_t));
-  memcpy(&eth_buffer[6], interface_mac[if_index], sizeof(macaddr_t));
+  HAL_BuildL2Header(if_index, dst_mac, eth_buffer);
+  memcpy(&eth_buffer[IP_OFFSET], buffer, length);
+  int res = HAL_SendFrame(if_index, eth_buffer, length + IP_OFFSET);
+  free(eth_buffer);
+  return res;
+}
+
+int HAL_SendIPPacketInPlace(int if_index, uint8_t *buffer, size_t length,
+                            macaddr_t dst_mac) {
+  // the caller left room for the header right in front of the packet
+  uint8_t *frame = buffer - IP_OFFSET;
+  int res = HAL_BuildL2Header(if_index, dst_mac, frame);
+  if (res < 0) {
+    return res;
+  }
+  return HAL_SendFrame(if_index, frame, length + IP_OFFSET);
+}
+
+uint32_t HAL_GetArpVersion() { return arp_cache.version; }
+
+int HAL_HoldIPPacket(int if_index, in_addr_t nexthop, const uint8_t *buffer,
+                     size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return arpHold(&arp_hold, if_index, nexthop, buffer, length, HAL_GetTicks());
+}
+
+int HAL_BuildL2Header(int if_index, macaddr_t dst_mac, uint8_t *header) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
   // VLAN
-  eth_buffer[12] = 0x81;
-  eth_buffer[13] = 0x00;
-  eth_buffer[14] = 0x00;
-  eth_buffer[15] = if_index;
+  header[12] = 0x81;
+  header[13] = 0x00;
+  header[14] = 0x00;
+  header[15] = if_index;
   // IPv4
-  eth_buffer[16] = 0x08;
-  eth_buffer[17] = 0x00;
-  memcpy(&eth_buffer[IP_OFFSET], buffer, length);
+  header[16] = 0x08;
+  header[17] = 0x00;
+  return IP_OFFSET;
+}
+
+int HAL_SendFrame(int if_index, uint8_t *frame, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
   struct pcap_pkthdr header;
-  header.caplen = header.len = length + IP_OFFSET;
+  header.caplen = header.len = length;
 
   struct timespec tp = {0};
   clock_gettime(CLOCK_MONOTONIC, &tp);
@@ -317,8 +387,68 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
     pcap_dumper = pcap_dump_open(pcap_out_handle, "-");
     outputInited = true;
   }
-  pcap_dump((u_char *)pcap_dumper, &header, eth_buffer);
-  free(eth_buffer);
+  pcap_dump((u_char *)pcap_dumper, &header, frame);
+  return 0;
+}
+// no transmit queue here: frames go out as soon as they are queued
+int HAL_SendIPPacketBatch(int if_index, HAL_IPPacket *packets, int count) {
+  if (packets == NULL || count < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (int i = 0; i < count; i++) {
+    int res = HAL_SendIPPacket(if_index, packets[i].buffer, packets[i].length,
+                               packets[i].dst_mac);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+int HAL_QueueFrame(int if_index, uint8_t *frame, size_t length) {
+  return HAL_SendFrame(if_index, frame, length);
+}
+
+int HAL_FlushSendQueues() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
   return 0;
 }
-}
\ No newline at end of file
+
+// pcap_next_ex reuses its buffer, packets are copied into the common slots
+int HAL_BorrowIPPacketBatch(int if_index_mask, HAL_BorrowedPacket *packets,
+                            int count, int64_t timeout) {
+  return lendBorrow(if_index_mask, packets, count, timeout);
+}
+
+int HAL_QueueBorrowedPacket(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len) {
+  return lendQueue(if_index, packet, header_len);
+}
+
+int HAL_ReleaseBorrowedPacket(HAL_BorrowedPacket *packet) {
+  return lendRelease(packet);
+}
+
+// frames are received on the calling thread, there is no queue
+int HAL_GetRxQueueStats(int if_index, HAL_RxQueueStats *stats) {
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+// a single worker: frames are received on the calling thread
+int HAL_SetWorkerCount(int count) {
+  if (count < 1 || count > HAL_WORKERS_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return count == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_SetWorker(int worker) {
+  return worker == 0 ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_WakeWorker(int worker) {
+  return worker == 0 ? HAL_ERR_NOT_SUPPORTED : HAL_ERR_INVALID_PARAMETER;
+}
+}
@@ -0,0 +1,766 @@
+#include "router_hal.h"
+#include "router_hal_common.h"
+#include <stdio.h>
+
+#include <ifaddrs.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+
+// same interface names as the Linux backend
+#ifndef HAL_PLATFORM_TESTING
+#include "../linux/platform/standard.h"
+#else
+#include "../linux/platform/testing.h"
+#endif
+
+#include "xdp_prog.h"
+#include "xsk.h"
+
+const int IP_OFFSET = 14;
+// chunks each interface keeps in its fill ring, the rest is for sending
+const uint32_t RX_FILL = XSK_FRAME_NR / 2 / N_IFACE_ON_BOARD;
+// HAL_QueueFrame kicks the TX ring after this many frames
+const uint32_t TX_QUEUE_LEN = 64;
+
+bool inited = false;
+int debugEnabled = 0;
+in_addr_t interface_addrs[N_IFACE_ON_BOARD] = {0};
+macaddr_t interface_mac[N_IFACE_ON_BOARD] = {0};
+
+XskUmem umem;
+Xsk xsks[N_IFACE_ON_BOARD];
+XdpProg xdp_progs[N_IFACE_ON_BOARD];
+
+// AF_XDP sockets are waited on with epoll, as in the Linux backend
+int epoll_fd = -1;
+int epoll_mask = 0; // interfaces currently registered with epoll_fd
+int next_port = 0;  // where the next receive starts its round robin
+// HAL_WakeWorker: set when the receive call should return, and signalled
+// on wake_fd, which is in the epoll set
+int wake_pending = 0;
+int wake_fd = -1;
+
+HAL_ArpCache arp_cache;
+HAL_ArpHoldQueue arp_hold; // packets waiting for ARP
+
+// steer the IPv4 and ARP frames of interface i into a new AF_XDP socket
+static bool openInterface(int i, int umem_fd) {
+  unsigned int ifindex = if_nametoindex(interfaces[i]);
+  if (ifindex == 0) {
+    return false;
+  }
+  static char log[4096];
+  if (!xdpProgLoad(xdp_progs[i], debugEnabled ? log : NULL, sizeof(log))) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: loading XDP program failed with %s\n%s",
+              strerror(errno), log);
+    }
+    return false;
+  }
+  if (!xskOpen(xsks[i], umem, ifindex, umem_fd)) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: AF_XDP socket on %s failed with %s\n",
+              interfaces[i], strerror(errno));
+    }
+    xdpProgClose(xdp_progs[i]);
+    return false;
+  }
+  if (!xdpProgBind(xdp_progs[i], xsks[i].fd) ||
+      !xdpProgAttach(xdp_progs[i], ifindex)) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: attaching XDP program to %s failed with %s\n",
+              interfaces[i], strerror(errno));
+    }
+    xdpProgClose(xdp_progs[i]);
+    close(xsks[i].fd);
+    xsks[i].fd = -1;
+    return false;
+  }
+  xskRefill(xsks[i], umem, RX_FILL);
+  return true;
+}
+
+// a free UMEM chunk to build a frame in, NULL if every chunk is in flight
+static uint8_t *txAlloc(uint64_t *addr) {
+  if (umem.n_free == 0) {
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      if (xsks[i].fd >= 0) {
+        if (xsks[i].tx_pending > 0) {
+          xskKick(xsks[i]);
+        }
+        xskReclaim(xsks[i], umem);
+      }
+    }
+    if (umem.n_free == 0) {
+      return NULL;
+    }
+  }
+  *addr = umem.free_frames[--umem.n_free];
+  return umem.area + *addr;
+}
+
+// put the frame at UMEM address addr on the TX ring of if_index, the chunk
+// is no longer ours afterwards
+static int txSubmit(int if_index, uint64_t addr, size_t length) {
+  Xsk &x = xsks[if_index];
+  if (!xskTxPush(x, addr, length)) {
+    xskKick(x);
+    if (!xskTxPush(x, addr, length)) {
+      umem.free_frames[umem.n_free++] = xskChunk(addr);
+      if (debugEnabled) {
+        fprintf(stderr, "txSubmit: TX ring of %s is full\n",
+                interfaces[if_index]);
+      }
+      return HAL_ERR_QUEUE_FULL;
+    }
+  }
+  return 0;
+}
+
+static int txKick(int if_index) {
+  Xsk &x = xsks[if_index];
+  int res = 0;
+  if (xskKick(x) != 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "txKick: sendto failed with %s\n", strerror(errno));
+    }
+    res = HAL_ERR_UNKNOWN;
+  }
+  xskReclaim(x, umem);
+  return res;
+}
+
+extern "C" {
+int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
+  if (inited) {
+    return 0;
+  }
+  debugEnabled = debug;
+
+  // find matching interfaces and get their MAC address
+  struct ifaddrs *ifaddr, *ifa;
+  if (getifaddrs(&ifaddr) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: getifaddrs failed with %s\n", strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+
+  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL)
+      continue;
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+      if (ifa->ifa_addr->sa_family == AF_PACKET &&
+          strcmp(ifa->ifa_name, interfaces[i]) == 0) {
+        // found
+        memcpy(interface_mac[i],
+               ((struct sockaddr_ll *)ifa->ifa_addr)->sll_addr,
+               sizeof(macaddr_t));
+        arpAddPermanent(&arp_cache, if_addrs[i], i, interface_mac[i]);
+        if (debugEnabled) {
+          fprintf(stderr, "HAL_Init: found MAC addr of interface %s\n",
+                  interfaces[i]);
+        }
+        break;
+      }
+    }
+  }
+  freeifaddrs(ifaddr);
+
+  if (!xskUmemInit(umem)) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: allocating UMEM failed with %s\n",
+              strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+  // the first socket registers the UMEM, the others share it
+  int umem_fd = -1;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (openInterface(i, umem_fd)) {
+      if (umem_fd < 0) {
+        umem_fd = xsks[i].fd;
+      }
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: AF_XDP socket enabled for %s\n",
+                interfaces[i]);
+      }
+    } else {
+      xsks[i].fd = -1;
+      if (debugEnabled) {
+        fprintf(stderr,
+                "HAL_Init: AF_XDP socket disabled for %s, either the interface "
+                "does not exist or permission is denied\n",
+                interfaces[i]);
+      }
+    }
+  }
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: epoll_create1 failed with %s\n", strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+  wake_fd = eventfd(0, EFD_NONBLOCK);
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  ev.data.u32 = N_IFACE_ON_BOARD; // not a port
+  if (wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_Init: eventfd failed with %s\n", strerror(errno));
+    }
+    return HAL_ERR_UNKNOWN;
+  }
+
+  memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
+
+  inited = true;
+  // send igmp to join RIP multicast group
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (xsks[i].fd >= 0) {
+      HAL_JoinIGMPGroup(i, if_addrs[i]);
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_Init: Joining RIP multicast group 224.0.0.9 for %s\n",
+                interfaces[i]);
+      }
+    }
+  }
+  return 0;
+}
+
+uint64_t HAL_GetTicks() {
+  struct timespec tp = {0};
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  // millisecond
+  return (uint64_t)tp.tv_sec * 1000 + (uint64_t)tp.tv_nsec / 1000000;
+}
+
+int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+
+  // handle multicast
+  if ((ip & 0xe0) == 0xe0) {
+    uint8_t multicasting_mac[6] = {0x01, 0, 0x5e, (uint8_t)((ip >> 8) & 0x7f), (uint8_t)(ip >> 16), (uint8_t)(ip >> 24)};
+    memcpy(o_mac, multicasting_mac, sizeof(macaddr_t));
+    return 0;
+  }
+
+  // lookup arp cache
+  uint32_t now = HAL_GetTicks();
+  HAL_ArpEntry *entry = arpLookup(&arp_cache, ip, if_index, now);
+  if (entry && arpResolved(entry)) {
+    memcpy(o_mac, entry->mac, sizeof(macaddr_t));
+    return 0;
+  } else if (xsks[if_index].fd >= 0 &&
+             (entry = arpInsert(&arp_cache, ip, if_index, now)) &&
+             arpRequestDue(entry, now)) {
+    // not found, send arp request
+    // rate limit arp request by 1 req/s
+    if (debugEnabled) {
+      fprintf(
+          stderr,
+          "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
+          inet_ntoa(in_addr{ip}));
+    }
+    uint8_t buffer[64];
+    arpBuildRequest(if_index, ip, NULL, buffer);
+
+    HAL_SendFrame(if_index, buffer, sizeof(buffer));
+  }
+  return HAL_ERR_IP_NOT_EXIST;
+}
+
+int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+
+  memcpy(o_mac, interface_mac[if_index], sizeof(macaddr_t));
+  return 0;
+}
+
+// make epoll_fd watch exactly the sockets in if_index_mask, so that
+// traffic on other interfaces does not wake us up
+static void epollSetMask(int if_index_mask) {
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    bool want = xsks[i].fd >= 0 && (if_index_mask & (1 << i));
+    bool have = epoll_mask & (1 << i);
+    if (want == have) {
+      continue;
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(epoll_fd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, xsks[i].fd,
+                  &ev) == 0) {
+      epoll_mask ^= 1 << i;
+    } else if (debugEnabled) {
+      fprintf(stderr, "epollSetMask: epoll_ctl failed with %s\n", strerror(errno));
+    }
+  }
+}
+
+// look at a received frame: ARP is learned (and answered) here, returns true
+// for IPv4 frames that should go up to the caller
+static bool handleFrame(int port, const uint8_t *packet, size_t caplen) {
+  if (caplen < IP_OFFSET) {
+    return false;
+  }
+  if (packet[12] == 0x08 && packet[13] == 0x00) {
+    // IPv4
+    return true;
+  }
+  if (packet[12] == 0x08 && packet[13] == 0x06) {
+    // ARP
+    // learn it
+    macaddr_t mac;
+    memcpy(mac, &packet[22], sizeof(macaddr_t));
+    in_addr_t ip;
+    memcpy(&ip, &packet[28], sizeof(in_addr_t));
+    arpLearn(&arp_cache, ip, port, mac, HAL_GetTicks());
+    arpHoldFlush(&arp_hold, port, ip, mac);
+    if (debugEnabled) {
+      fprintf(stderr, "HAL_ReceiveIPPacket: learned MAC address of %s\n",
+              inet_ntoa(in_addr{ip}));
+    }
+
+    in_addr_t dst_ip;
+    memcpy(&dst_ip, &packet[38], sizeof(in_addr_t));
+    // ask me: reply
+    if (dst_ip == interface_addrs[port] && packet[21] == 0x01) {
+      // reply
+      uint8_t buffer[64] = {0};
+      // dst mac
+      memcpy(buffer, &packet[6], sizeof(macaddr_t));
+      // src mac
+      macaddr_t mac;
+      HAL_GetInterfaceMacAddress(port, mac);
+      memcpy(&buffer[6], mac, sizeof(macaddr_t));
+      // ARP
+      buffer[12] = 0x08;
+      buffer[13] = 0x06;
+      // hardware type
+      buffer[15] = 0x01;
+      // protocol type
+      buffer[16] = 0x08;
+      // hardware size
+      buffer[18] = 0x06;
+      // protocol size
+      buffer[19] = 0x04;
+      // opcode
+      buffer[21] = 0x02;
+      // sender
+      memcpy(&buffer[22], mac, sizeof(macaddr_t));
+      memcpy(&buffer[28], &dst_ip, sizeof(in_addr_t));
+      // target
+      memcpy(&buffer[32], &packet[22], sizeof(macaddr_t));
+      memcpy(&buffer[38], &packet[28], sizeof(in_addr_t));
+
+      HAL_SendFrame(port, buffer, sizeof(buffer));
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_ReceiveIPPacket: replied ARP to %s\n",
+                inet_ntoa(in_addr{ip}));
+      }
+    }
+    // otherwise: learn and ignore
+  }
+  return false;
+}
+
+// take frames off the RX ring of port until packets[*n..count) (or
+// borrowed) is full or the ring is empty, returns how many frames were taken
+static uint32_t receiveFrom(int port, HAL_IPPacket *packets,
+                            HAL_BorrowedPacket *borrowed, int count, int *n) {
+  Xsk &x = xsks[port];
+  uint32_t ready = xskRingReady(x.rx);
+  uint32_t taken = 0;
+  while (taken < ready && *n < count) {
+    struct xdp_desc *d = xskDesc(x.rx, x.rx.cached++);
+    taken++;
+    const uint8_t *packet = umem.area + d->addr;
+    bool is_ip = handleFrame(port, packet, d->len);
+    if (is_ip && borrowed) {
+      // lent out, the chunk comes back through HAL_QueueBorrowedPacket or
+      // HAL_ReleaseBorrowedPacket
+      HAL_BorrowedPacket &b = borrowed[(*n)++];
+      b.buffer = umem.area + d->addr + IP_OFFSET;
+      b.length = d->len - IP_OFFSET;
+      memcpy(b.dst_mac, &packet[0], sizeof(macaddr_t));
+      memcpy(b.src_mac, &packet[6], sizeof(macaddr_t));
+      b.if_index = port;
+      b.handle = d->addr;
+      continue;
+    } else if (is_ip) {
+      HAL_IPPacket &p = packets[(*n)++];
+      p.length = d->len - IP_OFFSET;
+      memcpy(p.buffer, &packet[IP_OFFSET], p.size > p.length ? p.length : p.size);
+      memcpy(p.dst_mac, &packet[0], sizeof(macaddr_t));
+      memcpy(p.src_mac, &packet[6], sizeof(macaddr_t));
+      p.if_index = port;
+    }
+    umem.free_frames[umem.n_free++] = xskChunk(d->addr);
+  }
+  if (taken > 0) {
+    xskRingConsume(x.rx);
+    x.rx_held -= taken;
+  }
+  // also picks up chunks given back since the last call
+  xskRefill(x, umem, RX_FILL);
+  return taken;
+}
+
+int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
+                        macaddr_t src_mac, macaddr_t dst_mac, int64_t timeout,
+                        int *if_index) {
+  if ((if_index == NULL) || (buffer == NULL)) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  HAL_IPPacket packet;
+  packet.buffer = buffer;
+  packet.size = length;
+  int res = HAL_ReceiveIPPacketBatch(if_index_mask, &packet, 1, timeout);
+  if (res <= 0) {
+    return res;
+  }
+  memcpy(dst_mac, packet.dst_mac, sizeof(macaddr_t));
+  memcpy(src_mac, packet.src_mac, sizeof(macaddr_t));
+  *if_index = packet.if_index;
+  return packet.length;
+}
+
+// common part of HAL_ReceiveIPPacketBatch and HAL_BorrowIPPacketBatch,
+// parameters are already checked
+static int receiveBatch(int if_index_mask, HAL_IPPacket *packets,
+                        HAL_BorrowedPacket *borrowed, int count,
+                        int64_t timeout) {
+  bool flag = false;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (xsks[i].fd >= 0 && (if_index_mask & (1 << i))) {
+      flag = true;
+    }
+  }
+  if (!flag) {
+    if (debugEnabled) {
+      fprintf(stderr,
+              "HAL_ReceiveIPPacketBatch: no viable interfaces open for capture\n");
+    }
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  epollSetMask(if_index_mask);
+
+  int64_t begin = HAL_GetTicks();
+  if (arpAge(&arp_cache, begin, arpQueueProbe) > 0) {
+    HAL_FlushSendQueues();
+  }
+  arpHoldExpire(&arp_hold, begin);
+  int n = 0;
+  while (true) {
+    // drain what is already on the RX rings, round robin over the ports
+    bool drained = true;
+    for (int k = 0; k < N_IFACE_ON_BOARD && n < count; k++) {
+      int current_port = next_port;
+      next_port = (next_port + 1) % N_IFACE_ON_BOARD;
+      if ((if_index_mask & (1 << current_port)) == 0 ||
+          xsks[current_port].fd < 0) {
+        continue;
+      }
+      if (receiveFrom(current_port, packets, borrowed, count, &n) > 0) {
+        drained = false;
+      }
+    }
+    if (n == count || (n > 0 && drained)) {
+      return n;
+    }
+    if (!drained) {
+      continue;
+    }
+
+    if (__atomic_exchange_n(&wake_pending, 0, __ATOMIC_ACQUIRE)) {
+      // HAL_WakeWorker
+      return 0;
+    }
+    // nothing received: sleep until a port has data, time is up or we are
+    // woken up
+    int wait = -1; // -1 for infinity
+    if (timeout != -1) {
+      int64_t remaining = begin + timeout - (int64_t)HAL_GetTicks();
+      if (remaining <= 0) {
+        return 0;
+      }
+      wait = remaining > 0x7FFFFFFF ? 0x7FFFFFFF : (int)remaining;
+    }
+    struct epoll_event events[N_IFACE_ON_BOARD + 1];
+    int ready = epoll_wait(epoll_fd, events, N_IFACE_ON_BOARD + 1, wait);
+    if (ready < 0 && errno != EINTR) {
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_ReceiveIPPacketBatch: epoll_wait failed with %s\n",
+                strerror(errno));
+      }
+      return HAL_ERR_UNKNOWN;
+    }
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.u32 == N_IFACE_ON_BOARD) {
+        // wake_pending is checked on the next round
+        uint64_t value;
+        read(wake_fd, &value, sizeof(value));
+      }
+    }
+  }
+}
+
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_IPPacket *packets,
+                             int count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1) || (packets == NULL) || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return receiveBatch(if_index_mask, packets, NULL, count, timeout);
+}
+
+int HAL_BorrowIPPacketBatch(int if_index_mask, HAL_BorrowedPacket *packets,
+                            int count, int64_t timeout) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if ((if_index_mask & ((1 << N_IFACE_ON_BOARD) - 1)) == 0 ||
+      (timeout < 0 && timeout != -1) || (packets == NULL) || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return receiveBatch(if_index_mask, NULL, packets, count, timeout);
+}
+
+int HAL_ReleaseBorrowedPacket(HAL_BorrowedPacket *packet) {
+  if (packet == NULL || packet->buffer == NULL ||
+      packet->handle >= (uint64_t)XSK_FRAME_NR * XSK_FRAME_SIZE) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  umem.free_frames[umem.n_free++] = xskChunk(packet->handle);
+  packet->buffer = NULL;
+  return 0;
+}
+
+// frames are received on the calling thread, there is no queue
+int HAL_GetRxQueueStats(int if_index, HAL_RxQueueStats *stats) {
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+// a single worker: frames are received on the calling thread
+int HAL_SetWorkerCount(int count) {
+  if (count < 1 || count > HAL_WORKERS_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return count == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_SetWorker(int worker) {
+  return worker == 0 ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_WakeWorker(int worker) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (worker != 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  __atomic_store_n(&wake_pending, 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  write(wake_fd, &one, sizeof(one));
+  return 0;
+}
+
+int HAL_QueueBorrowedPacket(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (packet == NULL || packet->buffer == NULL ||
+      header_len > HAL_L2_HEADER_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  uint64_t addr = packet->buffer - header_len - umem.area;
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || xsks[if_index].fd < 0 ||
+      xskChunk(addr) != xskChunk(packet->handle)) {
+    HAL_ReleaseBorrowedPacket(packet);
+    return if_index >= 0 && if_index < N_IFACE_ON_BOARD
+               ? HAL_ERR_IFACE_NOT_EXIST
+               : HAL_ERR_INVALID_PARAMETER;
+  }
+  // the chunk moves from the RX side of one socket to the TX ring of
+  // another, the packet is never copied
+  packet->buffer = NULL;
+  int res = txSubmit(if_index, addr, header_len + packet->length);
+  if (res == 0 && xsks[if_index].tx_pending >= TX_QUEUE_LEN) {
+    res = txKick(if_index);
+  }
+  return res;
+}
+
+int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
+                     macaddr_t dst_mac) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 ||
+      length > XSK_FRAME_SIZE - IP_OFFSET) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (xsks[if_index].fd < 0) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  // build the frame right in a UMEM chunk
+  uint64_t addr;
+  uint8_t *frame = txAlloc(&addr);
+  if (!frame) {
+    return HAL_ERR_QUEUE_FULL;
+  }
+  HAL_BuildL2Header(if_index, dst_mac, frame);
+  memcpy(&frame[IP_OFFSET], buffer, length);
+  int res = txSubmit(if_index, addr, length + IP_OFFSET);
+  if (res != 0) {
+    return res;
+  }
+  return txKick(if_index);
+}
+
+int HAL_SendIPPacketInPlace(int if_index, uint8_t *buffer, size_t length,
+                            macaddr_t dst_mac) {
+  // the caller left room for the header right in front of the packet
+  uint8_t *frame = buffer - IP_OFFSET;
+  int res = HAL_BuildL2Header(if_index, dst_mac, frame);
+  if (res < 0) {
+    return res;
+  }
+  return HAL_SendFrame(if_index, frame, length + IP_OFFSET);
+}
+
+uint32_t HAL_GetArpVersion() { return arp_cache.version; }
+
+int HAL_HoldIPPacket(int if_index, in_addr_t nexthop, const uint8_t *buffer,
+                     size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return arpHold(&arp_hold, if_index, nexthop, buffer, length, HAL_GetTicks());
+}
+
+int HAL_BuildL2Header(int if_index, macaddr_t dst_mac, uint8_t *header) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac[if_index], sizeof(macaddr_t));
+  // IPv4
+  header[12] = 0x08;
+  header[13] = 0x00;
+  return IP_OFFSET;
+}
+
+int HAL_SendFrame(int if_index, uint8_t *frame, size_t length) {
+  int res = HAL_QueueFrame(if_index, frame, length);
+  if (res != 0) {
+    return res;
+  }
+  return txKick(if_index);
+}
+
+int HAL_SendIPPacketBatch(int if_index, HAL_IPPacket *packets, int count) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || packets == NULL ||
+      count < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (xsks[if_index].fd < 0) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  int res = 0;
+  for (int i = 0; i < count; i++) {
+    HAL_IPPacket &p = packets[i];
+    if (p.length > XSK_FRAME_SIZE - IP_OFFSET) {
+      return HAL_ERR_INVALID_PARAMETER;
+    }
+    uint64_t addr;
+    uint8_t *frame = txAlloc(&addr);
+    if (!frame) {
+      res = HAL_ERR_QUEUE_FULL;
+      continue;
+    }
+    HAL_BuildL2Header(if_index, p.dst_mac, frame);
+    memcpy(&frame[IP_OFFSET], p.buffer, p.length);
+    int submitted = txSubmit(if_index, addr, IP_OFFSET + p.length);
+    if (submitted != 0) {
+      res = submitted;
+    }
+  }
+  if (txKick(if_index) != 0) {
+    res = HAL_ERR_UNKNOWN;
+  }
+  return res;
+}
+
+int HAL_QueueFrame(int if_index, uint8_t *frame, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0 || length > XSK_FRAME_SIZE) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  if (xsks[if_index].fd < 0) {
+    return HAL_ERR_IFACE_NOT_EXIST;
+  }
+  uint64_t addr;
+  uint8_t *chunk = txAlloc(&addr);
+  if (!chunk) {
+    // every chunk is still on a ring
+    return HAL_ERR_QUEUE_FULL;
+  }
+  memcpy(chunk, frame, length);
+  int res = txSubmit(if_index, addr, length);
+  if (res == 0 && xsks[if_index].tx_pending >= TX_QUEUE_LEN) {
+    res = txKick(if_index);
+  }
+  return res;
+}
+
+int HAL_FlushSendQueues() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  int res = 0;
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    if (xsks[i].fd >= 0 && xsks[i].tx_pending > 0 && txKick(i) != 0) {
+      res = HAL_ERR_UNKNOWN;
+    }
+  }
+  return res;
+}
+}
@@ -0,0 +1,139 @@
+#ifndef __HAL_XDP_PROG_H__
+#define __HAL_XDP_PROG_H__
+
+// The XDP program that steers IPv4 and ARP frames of an interface into its
+// AF_XDP socket, loaded with the raw bpf() syscall so that no libbpf is
+// needed. Everything else (and every frame when no socket is bound) goes
+// on to the kernel stack.
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct XdpProg {
+  int map_fd;  // XSKMAP, key is the RX queue, value the AF_XDP socket
+  int prog_fd;
+  int link_fd; // closing it detaches the program
+};
+
+static int bpfCall(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src,
+                               int16_t off, int32_t imm) {
+  struct bpf_insn insn;
+  insn.code = code;
+  insn.dst_reg = dst;
+  insn.src_reg = src;
+  insn.off = off;
+  insn.imm = imm;
+  return insn;
+}
+
+// returns false on failure, errno tells why; log (may be NULL) receives
+// the verifier output
+static bool xdpProgLoad(XdpProg &p, char *log, size_t log_size) {
+  p.map_fd = p.prog_fd = p.link_fd = -1;
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 1; // one socket on queue 0
+  p.map_fd = bpfCall(BPF_MAP_CREATE, &attr);
+  if (p.map_fd < 0) {
+    return false;
+  }
+
+  const uint8_t R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4;
+  struct bpf_insn insns[] = {
+      // r2 = data, r3 = data_end
+      bpfInsn(BPF_LDX | BPF_W | BPF_MEM, R2, R1, offsetof(struct xdp_md, data), 0),
+      bpfInsn(BPF_LDX | BPF_W | BPF_MEM, R3, R1, offsetof(struct xdp_md, data_end), 0),
+      // no room for an ethernet header: pass
+      bpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, R4, R2, 0, 0),
+      bpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, 14),
+      bpfInsn(BPF_JMP | BPF_JGT | BPF_X, R4, R3, 3, 0),
+      // IPv4 or ARP: redirect
+      bpfInsn(BPF_LDX | BPF_H | BPF_MEM, R4, R2, 12, 0),
+      bpfInsn(BPF_JMP | BPF_JEQ | BPF_K, R4, 0, 3, htons(0x0800)),
+      bpfInsn(BPF_JMP | BPF_JEQ | BPF_K, R4, 0, 2, htons(0x0806)),
+      // pass
+      bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS),
+      bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      // return bpf_redirect_map(&map, ctx->rx_queue_index, XDP_PASS)
+      bpfInsn(BPF_LDX | BPF_W | BPF_MEM, R2, R1, offsetof(struct xdp_md, rx_queue_index), 0),
+      bpfInsn(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, p.map_fd),
+      bpfInsn(0, 0, 0, 0, 0),
+      bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, XDP_PASS),
+      bpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+      bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)(uintptr_t)insns;
+  attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+  attr.license = (uint64_t)(uintptr_t) "GPL";
+  if (log) {
+    log[0] = '\0';
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = log_size;
+    attr.log_level = 1;
+  }
+  p.prog_fd = bpfCall(BPF_PROG_LOAD, &attr);
+  if (p.prog_fd < 0) {
+    close(p.map_fd);
+    p.map_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+// native mode first, generic (skb) mode works on any device including veth
+static bool xdpProgAttach(XdpProg &p, unsigned int ifindex) {
+  const uint32_t modes[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+  for (uint32_t mode : modes) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = p.prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = mode;
+    p.link_fd = bpfCall(BPF_LINK_CREATE, &attr);
+    if (p.link_fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// make the program hand frames of RX queue 0 to socket xsk_fd
+static bool xdpProgBind(XdpProg &p, int xsk_fd) {
+  uint32_t key = 0;
+  uint32_t value = xsk_fd;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = p.map_fd;
+  attr.key = (uint64_t)(uintptr_t)&key;
+  attr.value = (uint64_t)(uintptr_t)&value;
+  attr.flags = BPF_ANY;
+  return bpfCall(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+static void xdpProgClose(XdpProg &p) {
+  int *fds[] = {&p.link_fd, &p.prog_fd, &p.map_fd};
+  for (int *fd : fds) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef __HAL_XDP_XSK_H__
+#define __HAL_XDP_XSK_H__
+
+// AF_XDP sockets on top of a single UMEM shared by every interface, so a
+// frame received on one interface can be put on the TX ring of another by
+// passing its address around. The UMEM is carved into XSK_FRAME_SIZE
+// chunks; a chunk is always owned by exactly one of: the free pool, a fill
+// or RX ring, a TX or completion ring, or the HAL while it handles it.
+#include <errno.h>
+#include <linux/if_xdp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+const uint32_t XSK_FRAME_SIZE = 4096;
+const uint32_t XSK_FRAME_NR = 4096;
+const uint32_t XSK_RING_SIZE = 2048; // for each of the four rings
+
+// a single producer/single consumer ring shared with the kernel
+struct XskRing {
+  uint32_t *producer;
+  uint32_t *consumer;
+  void *desc; // uint64_t for fill/completion, struct xdp_desc for RX/TX
+  uint32_t cached; // our copy of the index we own (producer or consumer)
+  void *map;
+  size_t map_len;
+};
+
+struct XskUmem {
+  uint8_t *area;
+  uint64_t free_frames[XSK_FRAME_NR]; // chunk addresses
+  uint32_t n_free;
+};
+
+struct Xsk {
+  int fd; // -1 if not open
+  XskRing fill, comp, rx, tx;
+  uint32_t rx_held;    // chunks in the fill or RX ring
+  uint32_t tx_pending; // descriptors produced since the last kick
+};
+
+static bool xskRingMap(XskRing &r, int fd, const struct xdp_ring_offset &off,
+                       size_t desc_size, uint64_t pgoff) {
+  r.map_len = off.desc + XSK_RING_SIZE * desc_size;
+  r.map = mmap(NULL, r.map_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (r.map == MAP_FAILED) {
+    r.map = NULL;
+    return false;
+  }
+  r.producer = (uint32_t *)((uint8_t *)r.map + off.producer);
+  r.consumer = (uint32_t *)((uint8_t *)r.map + off.consumer);
+  r.desc = (uint8_t *)r.map + off.desc;
+  r.cached = 0;
+  return true;
+}
+
+// producer side (fill, TX): free entries
+static uint32_t xskRingFree(XskRing &r) {
+  return XSK_RING_SIZE -
+         (r.cached - __atomic_load_n(r.consumer, __ATOMIC_ACQUIRE));
+}
+
+// consumer side (RX, completion): entries ready
+static uint32_t xskRingReady(XskRing &r) {
+  return __atomic_load_n(r.producer, __ATOMIC_ACQUIRE) - r.cached;
+}
+
+// publish everything produced (or release everything consumed) so far
+static void xskRingProduce(XskRing &r) {
+  __atomic_store_n(r.producer, r.cached, __ATOMIC_RELEASE);
+}
+
+static void xskRingConsume(XskRing &r) {
+  __atomic_store_n(r.consumer, r.cached, __ATOMIC_RELEASE);
+}
+
+static uint64_t *xskAddr(XskRing &r, uint32_t i) {
+  return (uint64_t *)r.desc + (i & (XSK_RING_SIZE - 1));
+}
+
+static struct xdp_desc *xskDesc(XskRing &r, uint32_t i) {
+  return (struct xdp_desc *)r.desc + (i & (XSK_RING_SIZE - 1));
+}
+
+static bool xskUmemInit(XskUmem &u) {
+  void *area = mmap(NULL, (size_t)XSK_FRAME_NR * XSK_FRAME_SIZE,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED) {
+    return false;
+  }
+  u.area = (uint8_t *)area;
+  for (uint32_t i = 0; i < XSK_FRAME_NR; i++) {
+    u.free_frames[i] = (uint64_t)(XSK_FRAME_NR - 1 - i) * XSK_FRAME_SIZE;
+  }
+  u.n_free = XSK_FRAME_NR;
+  return true;
+}
+
+// chunk address of anything inside it (RX descriptors point past headroom)
+static uint64_t xskChunk(uint64_t addr) { return addr & ~(uint64_t)(XSK_FRAME_SIZE - 1); }
+
+// opens a socket on RX queue 0 of ifindex; umem_fd is the socket that
+// registered the UMEM, or -1 to register it on this one. Returns false and
+// leaves x.fd == -1 on failure, errno tells why
+static bool xskOpen(Xsk &x, XskUmem &u, unsigned int ifindex, int umem_fd) {
+  memset(&x, 0, sizeof(x));
+  x.fd = -1;
+  int fd = socket(AF_XDP, SOCK_RAW, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int size = XSK_RING_SIZE;
+  struct xdp_mmap_offsets off;
+  socklen_t off_len = sizeof(off);
+  bool ok = true;
+  if (umem_fd < 0) {
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)u.area;
+    reg.len = (uint64_t)XSK_FRAME_NR * XSK_FRAME_SIZE;
+    reg.chunk_size = XSK_FRAME_SIZE;
+    reg.headroom = 0;
+    ok = setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == 0;
+  }
+  // every socket has its own fill and completion rings, even on a shared
+  // UMEM, since they are bound to different devices
+  ok = ok &&
+       setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == 0 &&
+       setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == 0 &&
+       setsockopt(fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == 0 &&
+       setsockopt(fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == 0 &&
+       getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) == 0 &&
+       xskRingMap(x.fill, fd, off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) &&
+       xskRingMap(x.comp, fd, off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) &&
+       xskRingMap(x.rx, fd, off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) &&
+       xskRingMap(x.tx, fd, off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+  if (ok) {
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = 0;
+    if (umem_fd < 0) {
+      // copy mode works everywhere, and sockets sharing the UMEM inherit it
+      sxdp.sxdp_flags = XDP_COPY;
+    } else {
+      sxdp.sxdp_flags = XDP_SHARED_UMEM;
+      sxdp.sxdp_shared_umem_fd = umem_fd;
+    }
+    ok = bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0;
+  }
+  if (!ok) {
+    XskRing *rings[] = {&x.fill, &x.comp, &x.rx, &x.tx};
+    for (XskRing *r : rings) {
+      if (r->map) {
+        munmap(r->map, r->map_len);
+        r->map = NULL;
+      }
+    }
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return false;
+  }
+  // the producer and consumer indexes start where the kernel left them
+  x.fill.cached = *x.fill.producer;
+  x.comp.cached = *x.comp.consumer;
+  x.rx.cached = *x.rx.consumer;
+  x.tx.cached = *x.tx.producer;
+  x.fd = fd;
+  return true;
+}
+
+// hand free chunks to the kernel for receiving, up to target of them
+static void xskRefill(Xsk &x, XskUmem &u, uint32_t target) {
+  uint32_t n = xskRingFree(x.fill);
+  if (n > target - x.rx_held) {
+    n = target - x.rx_held;
+  }
+  if (n > u.n_free) {
+    n = u.n_free;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    *xskAddr(x.fill, x.fill.cached++) = u.free_frames[--u.n_free];
+  }
+  if (n > 0) {
+    x.rx_held += n;
+    xskRingProduce(x.fill);
+  }
+}
+
+// return chunks whose transmission has completed to the free pool
+static void xskReclaim(Xsk &x, XskUmem &u) {
+  uint32_t n = xskRingReady(x.comp);
+  for (uint32_t i = 0; i < n; i++) {
+    u.free_frames[u.n_free++] = xskChunk(*xskAddr(x.comp, x.comp.cached++));
+  }
+  if (n > 0) {
+    xskRingConsume(x.comp);
+  }
+}
+
+// put a frame at UMEM address addr on the TX ring, false if it is full
+static bool xskTxPush(Xsk &x, uint64_t addr, uint32_t len) {
+  if (xskRingFree(x.tx) == 0) {
+    return false;
+  }
+  struct xdp_desc *d = xskDesc(x.tx, x.tx.cached++);
+  d->addr = addr;
+  d->len = len;
+  d->options = 0;
+  xskRingProduce(x.tx);
+  x.tx_pending++;
+  return true;
+}
+
+// have the kernel transmit everything on the TX ring; in copy mode it
+// sends a limited budget per call and asks to be called again
+static int xskKick(Xsk &x) {
+  x.tx_pending = 0;
+  for (int tries = 0; tries < (int)(XSK_RING_SIZE / 16); tries++) {
+    if (sendto(x.fd, NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0) {
+      return 0;
+    }
+    if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+      return -1;
+    }
+    if (__atomic_load_n(x.tx.consumer, __ATOMIC_ACQUIRE) == x.tx.cached) {
+      return 0; // all taken by the kernel
+    }
+  }
+  return 0;
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "router_hal.h"
+#include "router_hal_common.h"
 #include "xaxidma.h"
 #include "xaxiethernet.h"
 #include "xil_printf.h"
@@ -56,6 +57,8 @@ struct ArpTableEntry {
   macaddr_t mac;
   in_addr_t ip;
 } arpTable[ARP_TABLE_SIZE];
+uint32_t arpVersion = 0;
+struct HAL_ArpHoldQueue arpHoldQueue; // packets waiting for ARP
 
 void SpiWriteRegister(u8 addr, u8 data) {
   u8 writeBuffer[3];
@@ -293,6 +296,7 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
   }
   XAxiDma_Bd *bd;
   uint64_t begin = HAL_GetTicks();
+  arpHoldExpire(&arpHoldQueue, begin);
   uint64_t current_time = 0;
   while ((current_time = HAL_GetTicks()) < begin + timeout || timeout == -1) {
     if (XAxiDma_BdRingFromHw(rxRing, 1, &bd) == 1) {
@@ -326,7 +330,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         for (int i = 0; i < ARP_TABLE_SIZE; i++) {
           if (arpTable[i].if_index == vlan &&
               memcmp(arpTable[i].mac, mac, sizeof(macaddr_t)) == 0) {
-            arpTable[i].ip = ip;
+            if (arpTable[i].ip != ip) {
+              arpTable[i].ip = ip;
+              arpVersion++;
+            }
             insert = 0;
             break;
           }
@@ -338,6 +345,7 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
           arpTable[0].if_index = vlan;
           memcpy(arpTable[0].mac, mac, sizeof(macaddr_t));
           arpTable[0].ip = ip;
+          arpVersion++;
           if (debugEnabled) {
             xil_printf("HAL_ReceiveIPPacket: learned ARP from %d.%d.%d.%d\r\n",
                        ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF,
@@ -345,6 +353,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
           }
         }
 
+        if (vlan < N_IFACE_ON_BOARD) {
+          arpHoldFlush(&arpHoldQueue, vlan, ip, mac);
+        }
+
         in_addr_t dst_ip;
         memcpy(&dst_ip, &data[42], sizeof(in_addr_t));
         if (vlan < N_IFACE_ON_BOARD && dst_ip == interface_addrs[vlan] && data[25] == 0x01) {
@@ -413,6 +425,22 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
   return 0;
 }
 
+int HAL_ReceiveIPPacketBatch(int if_index_mask, HAL_IPPacket *packets,
+                             int count, int64_t timeout) {
+  if (packets == NULL || count <= 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  // one packet per call: a zero timeout does not poll the rx ring here
+  HAL_IPPacket *p = &packets[0];
+  int res = HAL_ReceiveIPPacket(if_index_mask, p->buffer, p->size, p->src_mac,
+                                p->dst_mac, timeout, &p->if_index);
+  if (res <= 0) {
+    return res;
+  }
+  p->length = res;
+  return 1;
+}
+
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac) {
   if (!inited) {
@@ -430,21 +458,143 @@ int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
   XAxiDma_BdClear(bd);
   XAxiDma_BdSetBufAddr(bd, addr);
   u8 *data = (u8 *)addr;
-  memcpy(data, dst_mac, sizeof(macaddr_t));
-  memcpy(&data[6], interface_mac, sizeof(macaddr_t));
+  HAL_BuildL2Header(if_index, dst_mac, data);
+  memcpy(&data[IP_OFFSET], buffer, length);
+  XAxiDma_BdSetLength(bd, length + IP_OFFSET, txRing->MaxTransferLen);
+  XAxiDma_BdSetCtrl(bd,
+                    XAXIDMA_BD_CTRL_TXSOF_MASK | XAXIDMA_BD_CTRL_TXEOF_MASK);
+  XAxiDma_BdRingToHw(txRing, 1, bd);
+  return 0;
+}
+
+int HAL_SendIPPacketInPlace(int if_index, uint8_t *buffer, size_t length,
+                            macaddr_t dst_mac) {
+  // the caller left room for the header right in front of the packet
+  uint8_t *frame = buffer - IP_OFFSET;
+  int res = HAL_BuildL2Header(if_index, dst_mac, frame);
+  if (res < 0) {
+    return res;
+  }
+  return HAL_SendFrame(if_index, frame, length + IP_OFFSET);
+}
+
+uint32_t HAL_GetArpVersion() { return arpVersion; }
+
+int HAL_HoldIPPacket(int if_index, in_addr_t nexthop, const uint8_t *buffer,
+                     size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return arpHold(&arpHoldQueue, if_index, nexthop, buffer, length,
+                 HAL_GetTicks());
+}
+
+int HAL_BuildL2Header(int if_index, macaddr_t dst_mac, uint8_t *header) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  memcpy(header, dst_mac, sizeof(macaddr_t));
+  memcpy(&header[6], interface_mac, sizeof(macaddr_t));
   // VLAN
-  data[12] = 0x81;
-  data[13] = 0x00;
+  header[12] = 0x81;
+  header[13] = 0x00;
   // PID
-  data[14] = 0x00;
-  data[15] = if_index + 1;
+  header[14] = 0x00;
+  header[15] = if_index + 1;
   // IPv4
-  data[16] = 0x08;
-  data[17] = 0x00;
-  memcpy(&data[IP_OFFSET], buffer, length);
-  XAxiDma_BdSetLength(bd, length + IP_OFFSET, txRing->MaxTransferLen);
+  header[16] = 0x08;
+  header[17] = 0x00;
+  return IP_OFFSET;
+}
+
+int HAL_SendFrame(int if_index, uint8_t *frame, size_t length) {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  if (if_index >= N_IFACE_ON_BOARD || if_index < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  XAxiDma_Bd *bd;
+  WaitTxBdAvailable();
+  XAxiDma_BdRingAlloc(txRing, 1, &bd);
+  txBufferUsed++;
+
+  UINTPTR addr = XAxiDma_BdGetBufAddr(bd);
+  XAxiDma_BdClear(bd);
+  XAxiDma_BdSetBufAddr(bd, addr);
+  memcpy((u8 *)addr, frame, length);
+  XAxiDma_BdSetLength(bd, length, txRing->MaxTransferLen);
   XAxiDma_BdSetCtrl(bd,
                     XAXIDMA_BD_CTRL_TXSOF_MASK | XAXIDMA_BD_CTRL_TXEOF_MASK);
   XAxiDma_BdRingToHw(txRing, 1, bd);
   return 0;
 }
+
+// no transmit queue here: frames go out as soon as they are queued
+int HAL_SendIPPacketBatch(int if_index, HAL_IPPacket *packets, int count) {
+  if (packets == NULL || count < 0) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  for (int i = 0; i < count; i++) {
+    int res = HAL_SendIPPacket(if_index, packets[i].buffer, packets[i].length,
+                               packets[i].dst_mac);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+int HAL_QueueFrame(int if_index, uint8_t *frame, size_t length) {
+  return HAL_SendFrame(if_index, frame, length);
+}
+
+int HAL_FlushSendQueues() {
+  if (!inited) {
+    return HAL_ERR_CALLED_BEFORE_INIT;
+  }
+  return 0;
+}
+
+// DMA buffers are recycled right away, packets are copied into the common
+// slots
+int HAL_BorrowIPPacketBatch(int if_index_mask, HAL_BorrowedPacket *packets,
+                            int count, int64_t timeout) {
+  return lendBorrow(if_index_mask, packets, count, timeout);
+}
+
+int HAL_QueueBorrowedPacket(int if_index, HAL_BorrowedPacket *packet,
+                            size_t header_len) {
+  return lendQueue(if_index, packet, header_len);
+}
+
+int HAL_ReleaseBorrowedPacket(HAL_BorrowedPacket *packet) {
+  return lendRelease(packet);
+}
+
+// frames are received on the calling thread, there is no queue
+int HAL_GetRxQueueStats(int if_index, HAL_RxQueueStats *stats) {
+  return HAL_ERR_NOT_SUPPORTED;
+}
+
+// a single worker: frames are received on the calling thread
+int HAL_SetWorkerCount(int count) {
+  if (count < 1 || count > HAL_WORKERS_MAX) {
+    return HAL_ERR_INVALID_PARAMETER;
+  }
+  return count == 1 ? 0 : HAL_ERR_NOT_SUPPORTED;
+}
+
+int HAL_SetWorker(int worker) {
+  return worker == 0 ? 0 : HAL_ERR_INVALID_PARAMETER;
+}
+
+int HAL_WakeWorker(int worker) {
+  return worker == 0 ? HAL_ERR_NOT_SUPPORTED : HAL_ERR_INVALID_PARAMETER;
+}
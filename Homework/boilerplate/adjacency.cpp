@@ -0,0 +1,81 @@
+#include "adjacency.h"
+#include "router.h"
+#include "router_hal.h"
+#include <stdint.h>
+
+// a cached adjacency is looked up in the HAL again this often, which tells
+// the HAL the neighbor is still in use so that it refreshes it in time
+const uint64_t ADJACENCY_CHECK_MS = 1000;
+// hosts on connected networks are cached in a direct-mapped table this big
+const int HOST_ADJACENCY_BITS = 10;
+
+// indexed by the nexthop id query_id() returns; every forwarding thread has
+// its own, so they never write to each other's cache lines
+static thread_local Adjacency *adjacencies = nullptr;
+// a connected route has one nexthop id for all of its hosts, so they get
+// their own slots, indexed by a hash of (host, if_index)
+static thread_local Adjacency *host_adjacencies = nullptr;
+
+// check adj against the HAL, or resolve it again for nexthop on if_index
+static const Adjacency *resolve(Adjacency &adj, uint32_t nexthop, uint32_t if_index,
+                                uint64_t now) {
+  uint32_t version = HAL_GetArpVersion();
+  bool valid = adj.header_len > 0 && adj.nexthop == nexthop &&
+               adj.if_index == if_index && adj.arp_version == version;
+  if (valid && now - adj.checked < ADJACENCY_CHECK_MS) {
+    return &adj;
+  }
+  macaddr_t mac;
+  if (HAL_ArpGetMacAddress(if_index, nexthop, mac) != 0) {
+    return nullptr;
+  }
+  adj.checked = now;
+  if (valid) {
+    // the MAC cannot have changed without a new version
+    return &adj;
+  }
+  int len = HAL_BuildL2Header(if_index, mac, adj.header);
+  if (len < 0) {
+    return nullptr;
+  }
+  adj.nexthop = nexthop;
+  adj.if_index = if_index;
+  adj.arp_version = version;
+  adj.header_len = len;
+  return &adj;
+}
+
+/**
+ * @brief 获取发往 nexthop 的链路层信息，缓存失效时通过 ARP 重新解析
+ * @param nexthop_id query_id 给出的 nexthop 编号
+ * @param nexthop 实际的下一跳
+ * @param if_index 出端口
+ * @param now 当前的 HAL_GetTicks()
+ * @return 查不到 MAC 地址时返回 nullptr，此时 HAL 会发出 ARP 请求
+ *
+ * 缓存记下了解析时的 nexthop、if_index 和 ARP 表版本，任何一个对不上都会重新解析，
+ * 所以编号被回收再分配时结果依然正确。
+ * 命中的缓存每隔 ADJACENCY_CHECK_MS 还会向 HAL 查询一次，HAL 据此知道这个邻居仍在使用，
+ * 会在表项过期前主动刷新它。
+ */
+const Adjacency *getAdjacency(uint32_t nexthop_id, uint32_t nexthop, uint32_t if_index,
+                              uint64_t now) {
+  if (!adjacencies) {
+    adjacencies = new Adjacency[NEXTHOP_MAX]();
+  }
+  return resolve(adjacencies[nexthop_id], nexthop, if_index, now);
+}
+
+/**
+ * @brief 同 getAdjacency，用于直连路由：下一跳就是目的主机 host
+ *
+ * 同一条直连路由下的主机共用一个 nexthop 编号，所以按 (host, if_index)
+ * 缓存在一个直接映射的表中，发往不同主机的报文交替到达时不会互相冲掉
+ */
+const Adjacency *getHostAdjacency(uint32_t host, uint32_t if_index, uint64_t now) {
+  if (!host_adjacencies) {
+    host_adjacencies = new Adjacency[1 << HOST_ADJACENCY_BITS]();
+  }
+  uint32_t slot = ((host ^ if_index) * 2654435761u) >> (32 - HOST_ADJACENCY_BITS);
+  return resolve(host_adjacencies[slot], host, if_index, now);
+}
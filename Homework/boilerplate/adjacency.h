@@ -0,0 +1,22 @@
+#ifndef _ADJACENCY_H
+#define _ADJACENCY_H
+
+#include "router_hal.h"
+#include <stdint.h>
+
+// a resolved nexthop: the interface to send on and a ready-made L2 header
+typedef struct {
+  uint32_t nexthop;     // big endian, the address the MAC was resolved for
+  uint32_t if_index;
+  uint32_t arp_version; // HAL_GetArpVersion() when it was resolved
+  uint64_t checked;     // HAL_GetTicks() when it was last looked up in the HAL
+  uint32_t header_len;  // 0 while unresolved
+  uint8_t header[HAL_L2_HEADER_MAX];
+} Adjacency;
+
+const Adjacency *getAdjacency(uint32_t nexthop_id, uint32_t nexthop, uint32_t if_index,
+                              uint64_t now);
+// for connected routes, where the nexthop is the destination host itself
+const Adjacency *getHostAdjacency(uint32_t host, uint32_t if_index, uint64_t now);
+
+#endif
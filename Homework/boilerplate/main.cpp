@@ -2,28 +2,39 @@
 #include "rip.h"
 #include "router.h"
 #include "utils.h"
+#include "adjacency.h"
+#include "spsc_ring.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector> 
 
 extern bool validateIPChecksum(uint8_t *packet, size_t len);
-extern uint16_t valSum(const uint8_t *packet, size_t len);
 extern void update(bool insert, RoutingTableEntry entry);
 extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+extern bool query_id(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *nexthop_id);
 // extern bool forward(uint8_t *packet, size_t len);
 bool forwardFast(uint8_t *packet, size_t len);
 extern bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output);
-extern uint32_t assemble(const RipPacket *rip, uint8_t *buffer);
+extern uint32_t assemble(const RipPacket *rip, uint8_t *buffer, uint64_t *sum);
 extern uint32_t endianSwap(uint32_t a);
 extern std::vector<RoutingTableEntry>::iterator find(const RoutingTableEntry &entry);
 extern std::vector<RoutingTableEntry> routing_table;
 
-uint8_t packet[2048];
-uint8_t output[2048];
+// received packets are handled in bursts of up to BURST_SIZE, they are
+// borrowed from the HAL and forwarded packets are sent from where they are
+const int BURST_SIZE = 32;
+HAL_BorrowedPacket rx_burst[BURST_SIZE];
+int burst_len = 0; // packets in rx_burst
+int burst_pos = 0; // next one to handle
 
 // TODO: 你可以按需进行修改，注意端序
 // R3:
@@ -42,13 +53,439 @@ uint8_t output[2048];
 in_addr_t addrs[N_IFACE_ON_BOARD] = {0x0103a8c0, 0x0101a8c0};
 // 组播地址： 224.0.0.9
 const in_addr_t MULTICAST_ADDR = 0x90000e0;
+// learned routes not refreshed for this long are dropped (ms)
+const uint64_t ROUTE_TIMEOUT = 180 * 1000;
+
+// RIP runs on a control thread of its own, so that periodic updates and
+// walks of routing_table never hold up forwarding. Worker 0 hands it the
+// packets addressed to the router through to_control and sends what it
+// puts in from_control; the control thread only calls into the HAL to wake
+// worker 0 up. It is the only caller of update(), which publishes FIB
+// changes that query_id() picks up without taking a lock
+const uint32_t CONTROL_PACKET_MAX = 20 + 8 + 4 + RIP_MAX_ENTRY * 20; // a full RIP packet
+typedef struct {
+  uint32_t if_index;
+  macaddr_t mac;   // source MAC of a received packet, destination of a sent one
+  uint32_t length; // of the IP packet
+  uint8_t buffer[HAL_L2_HEADER_MAX + CONTROL_PACKET_MAX]; // IP packet at HAL_L2_HEADER_MAX
+} ControlPacket;
+static SpscRing<ControlPacket, 64> to_control;
+const uint32_t FROM_CONTROL_SIZE = 256;
+static SpscRing<ControlPacket, FROM_CONTROL_SIZE> from_control;
+static std::atomic<bool> control_stop(false);
+static std::atomic<bool> control_done(false);
+// the control thread sleeps on control_wake until worker 0 hands it a
+// packet or makes room in from_control, or its timer is due. Worker 0 waits
+// in the HAL and is woken up by HAL_WakeWorker when there is something to
+// send; on backends without it, it waits no longer than CONTROL_POLL_MS so
+// that what the control thread sends goes out in time (ms)
+static std::mutex control_lock;
+static std::condition_variable control_wake;
+const int RECEIVE_TIMEOUT_MS = 1000;
+const int CONTROL_POLL_MS = 10;
+
+// packets the HAL could not queue for sending, mostly because the kernel
+// is behind under overload (HAL_ERR_QUEUE_FULL); they are dropped
+static std::atomic<uint64_t> tx_dropped(0);
+
+static ControlPacket control_in;  // worker 0: packets for the control thread are copied here
+static ControlPacket control_out; // control thread: outgoing packets are built here
+static uint8_t *const out_ip = &control_out.buffer[HAL_L2_HEADER_MAX];
+static bool control_queued = false; // control thread: pushed since the last controlFlush
+
+// wake up whoever waits on control_wake
+static void controlNotify() {
+  // a waiter checks its condition with control_lock held, so it either sees
+  // what was done before this or is already asleep
+  { std::lock_guard<std::mutex> lock(control_lock); }
+  control_wake.notify_all();
+}
+
+// control thread: have worker 0 send what controlSend queued
+static void controlFlush() {
+  if (!control_queued) {
+    return;
+  }
+  control_queued = false;
+  HAL_WakeWorker(0);
+  // when it is waiting for us to exit
+  controlNotify();
+}
+
+// control thread: have worker 0 send the packet in out_ip, dst_mac is
+// nullptr for multicast
+static void controlSend(int if_index, uint32_t length, const uint8_t *dst_mac) {
+  control_out.if_index = if_index;
+  control_out.length = length;
+  if (dst_mac) {
+    memcpy(control_out.mac, dst_mac, sizeof(macaddr_t));
+  }
+  // routing updates are not dropped, the control thread waits for worker 0
+  // to make room instead
+  while (!spscPush(from_control, control_out)) {
+    controlFlush();
+    std::unique_lock<std::mutex> lock(control_lock);
+    control_wake.wait(lock, [] { return spscDepth(from_control) < FROM_CONTROL_SIZE; });
+  }
+  control_queued = true;
+}
+
+// worker 0: send what the control thread has queued
+static void sendControlPackets() {
+  static ControlPacket p;
+  bool sent = false;
+  while (spscPop(from_control, &p)) {
+    sent = true;
+    uint8_t *packet = &p.buffer[HAL_L2_HEADER_MAX];
+    in_addr_t dst_addr;
+    memcpy(&dst_addr, &packet[16], sizeof(in_addr_t));
+    int res;
+    if (dst_addr == MULTICAST_ADDR) {
+      res = HAL_ArpGetMacAddress(p.if_index, MULTICAST_ADDR, p.mac);
+      assert(res == 0);
+    }
+    res = HAL_SendIPPacketInPlace(p.if_index, packet, p.length, p.mac);
+    if (res != 0) {
+      tx_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  if (sent) {
+    // the control thread may be waiting for room
+    controlNotify();
+  }
+}
+
+// control thread: 3a, a packet addressed to the router
+static void handleControlPacket(ControlPacket &p) {
+  uint8_t *packet = &p.buffer[HAL_L2_HEADER_MAX];
+  uint8_t *src_mac = p.mac;
+  int if_index = p.if_index;
+  uint32_t packet_len = p.length;
+  in_addr_t src_addr, dst_addr;
+  memcpy(&src_addr, &packet[12], sizeof(in_addr_t));
+  memcpy(&dst_addr, &packet[16], sizeof(in_addr_t));
+  // printf("dst is me\n");
+  RipPacket rip;
+  // is this packet a RIP?
+  if (disassemble(packet, packet_len, &rip)) {
+    if (rip.command == CMD_REQUEST) {
+      // 3a.3 如果是 Request 包，就遍历本地的路由表，构造出一个 RipPacket 结构体，
+      //      然后调用你编写的 assemble 函数，另外再把 IP 和 UDP 头补充在前面，
+      //      通过 HAL_SendIPPacket 发回询问的网口
+      RipPacket resp;
+      // fill resp with all route entries
+      int idx_in_rt = 0;
+      do {
+        uint32_t entries_to_send = routing_table.size() - idx_in_rt;
+        resp.numEntries = std::min(entries_to_send, (uint32_t)RIP_MAX_ENTRY);
+        resp.command = CMD_RESPONSE;
+        for (int i = 0; i < resp.numEntries; ++i) {
+          resp.entries[i] = rtEntry2RipEntry(routing_table[idx_in_rt + i]); // TODO use [i]
+        }
+        // assemble rip packet
+        uint64_t rip_sum;
+        uint32_t rip_len = assemble(&rip, &out_ip[20 + 8], &rip_sum);
+        // assemble ip & udp head
+        uint32_t tot_len = writeIpUdpHead(out_ip, rip_len, dst_addr, src_addr, rip_sum);
+        // send it back
+        controlSend(if_index, tot_len, src_mac);
+
+        idx_in_rt += resp.numEntries;
+      } while (idx_in_rt < routing_table.size()); // possibly send multiple times
+    } else {
+      // 3a.2 如果是 Response 包，就调用你编写的 query 和 update 函数进行查询和更新，
+      //      注意此时的 RoutingTableEntry 可能要添加新的字段（如metric、timestamp），
+      //      如果有路由更新的情况，可能需要构造出 RipPacket 结构体，调用你编写的 assemble 函数，
+      //      再把 IP 和 UDP 头补充在前面，通过 HAL_SendIPPacket 把它发到别的网口上
+      // use query and update
+
+      // printf("got response packet\n");
+      bool did_update_rt = false;
+      for (int i = 0; i < rip.numEntries; ++i) {
+        const RipEntry &rpe = rip.entries[i];
+        // printf("\033[31mrpe ip: %u.%u.%u.%u\033[0m\n", (uint8_t)rpe.addr, (uint8_t)(rpe.addr>>8), (uint8_t)(rpe.addr>>16), (uint8_t)(rpe.addr>>24));
+        uint8_t metric = (uint8_t)endianSwap(rpe.metric);
+        if (metric + 1 > 16) {
+          // deleting this route entry ?
+          bool is_direct = false;
+          for (int i = 0; i < N_IFACE_ON_BOARD; ++i) {
+            if ((rpe.addr & rpe.mask) == (addrs[i] & 0x00ffffff)) {
+              is_direct = true;
+              break;
+            }
+          }
+          if (is_direct) {
+            // printf("protect direct routing\n");
+            continue; // protect direct routing
+          }
+          auto rte = RipEntry2rtEntry(rpe);
+          auto where = find(rte);
+          if (where == routing_table.end()) {
+            // printf("Fail to delete in routing table, the entry is not found.");
+            // printf("ip: %u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
+            continue;
+          }
+          if (where->if_index != if_index) {
+            // printf("protect route entry for if_index not match\n");
+            continue;
+          }
+          // printf("\033[32mdeleting route entry: \033[0m");
+          // printf("%u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
+          did_update_rt = true;
+          update(false, rte);
+          RipPacket resp; // construct expire packet
+          resp.command = CMD_RESPONSE;
+          resp.numEntries = 1;
+          resp.entries[0] = rpe;
+          uint64_t rip_sum;
+          auto rip_len = assemble(&resp, &out_ip[20 + 8], &rip_sum);
+          // multicast expire packet to all if except in_if
+          // for (int out_if = 0; out_if < N_IFACE_ON_BOARD; ++out_if) {
+          //   if (out_if == if_index) continue; // avoid sending back
+          //   auto tot_len = writeIpUdpHead(out_ip, rip_len, addrs[out_if], MULTICAST_ADDR, rip_sum);
+          //   macaddr_t multicast_mac;
+          //   res = HAL_ArpGetMacAddress(out_if, MULTICAST_ADDR, multicast_mac);
+          //   assert(res == 0);
+          //   res = HAL_SendIPPacketInPlace(out_if, out_ip, tot_len, multicast_mac);
+          //   assert(res == 0);
+          //   printf("expire packet sent to %d\n", out_if);
+          // }
+        } else {
+          // insert / update?
+          RoutingTableEntry rte = {
+            .addr = rpe.addr,
+            .len = maskToLen(rpe.mask),
+            .if_index = (uint32_t)if_index,
+            .nexthop = src_addr,
+            .metric = (uint8_t)(endianSwap(rpe.metric) + 1u),
+            .timestamp = HAL_GetTicks()
+          };
+          auto where = find(rte);
+          if (where == routing_table.end()) {
+            // not found, insert
+            did_update_rt = true;
+            // printf("\033[32minserting route entry: \033[0m");
+            // printf("%u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
+            update(true, rte);
+          } else {
+            // found the same route
+            if (metric + 1 <= where->metric) {
+              // update
+              did_update_rt = true;
+              // printf("\033[32mupdating route entry: \033[0m");
+              // printf("%u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
+              update(true, rte);
+              // wait until next periodical multicast
+              // or incrementally multicast now
+            }
+            // else: no op
+          }
+        }
+      }
+      // if (did_update_rt) {
+      //   printf("\033[32mupdated routing table\n");
+      //   printRoutingTable();
+      //   printf("\033[0m");
+      // }
+    }
+  } else { // if not a valid rip, ignore
+    // printf("not a valid rip\n");
+  }
+}
+
+// control thread: the periodic work, time is HAL_GetTicks()
+static void controlTimer(uint64_t time) {
+  // expire stale routes
+  for (size_t i = 0; i < routing_table.size();) {
+    const RoutingTableEntry &rte = routing_table[i];
+    if (rte.timestamp != 0 && rte.timestamp + ROUTE_TIMEOUT < time) {
+      update(false, rte); // the last entry is moved into i
+    } else {
+      ++i;
+    }
+  }
+
+  // multicast response to all neighbors:
+  RipPacket rip;
+  for (int if_index = 0; if_index < N_IFACE_ON_BOARD; ++if_index) {
+    // fill resp with all route entries:
+    int idx_in_rt = 0;
+    do {
+      rip.command = CMD_RESPONSE;
+      uint32_t entries_to_send = routing_table.size() - idx_in_rt;
+      entries_to_send = std::min(entries_to_send, (uint32_t)RIP_MAX_ENTRY);
+      rip.numEntries = 0;
+      for (int i = 0; i < entries_to_send; ++i) {
+        const RoutingTableEntry &rte = routing_table.at(idx_in_rt + i);
+        if (rte.if_index == if_index) continue; // TODO nexthop | addr
+        rip.entries[rip.numEntries++] = rtEntry2RipEntry(rte);
+      }
+      // assemble rip packet
+      uint64_t rip_sum;
+      uint32_t rip_len = assemble(&rip, &out_ip[20 + 8], &rip_sum);
+      // multicast through all ifs
+      
+      // assemble ip & udp head
+      uint32_t tot_len = writeIpUdpHead(out_ip, rip_len, addrs[if_index], MULTICAST_ADDR, rip_sum);
+      // the data plane looks up the multicast MAC
+      controlSend(if_index, tot_len, nullptr);
+      // printf("if_id = %u, idx_in_rt = %d\n", if_index, idx_in_rt);
+      
+      idx_in_rt += entries_to_send;
+    } while (idx_in_rt < routing_table.size()); // possibly send multiple times
+  } // for if_index
+  // printf("multicast done.\n");
+  printRoutingTable();
+}
+
+static void controlMain() {
+  static ControlPacket p;
+  uint64_t last_time = 0;
+  while (1) {
+    // 获取当前时间，处理定时任务
+    uint64_t time = HAL_GetTicks();
+    if (time > last_time + 5 * 1000) {
+      // 每 30s 做什么
+      // 例如：超时？发 RIP Request/Response
+      printf("\033[33mTimer Event\033[0m\n");
+      last_time = time;
+      controlTimer(time);
+    }
+    // checked first, so that everything queued before the stop is handled
+    bool stop = control_stop.load();
+    while (spscPop(to_control, &p)) {
+      handleControlPacket(p);
+    }
+    controlFlush();
+    if (stop) {
+      control_done = true;
+      controlNotify();
+      return;
+    }
+    // sleep until worker 0 hands us a packet or the timer is due
+    uint64_t now = HAL_GetTicks();
+    uint64_t due = last_time + 5 * 1000;
+    std::chrono::milliseconds wait(due >= now ? due - now + 1 : 0);
+    std::unique_lock<std::mutex> lock(control_lock);
+    control_wake.wait_for(lock, wait, [] {
+      return control_stop.load() || !spscEmpty(to_control);
+    });
+  }
+}
+
+// forwarding threads, e.g. -DFORWARD_WORKERS=4 together with -DHAL_RX_THREADS.
+// The HAL hands every flow to one of them; this thread is worker 0 and
+// also gets everything addressed to the router
+#ifndef FORWARD_WORKERS
+#define FORWARD_WORKERS 1
+#endif
+
+// 3b: forward a packet not addressed to the router, time is HAL_GetTicks().
+// Safe on any worker: the routing table is only read through query_id and
+// adjacencies are per thread. Returns false if it could not be updated
+static bool forwardPacket(HAL_BorrowedPacket &rx, in_addr_t dst_addr, uint64_t time) {
+  uint8_t *packet = rx.buffer;
+  auto packet_len = rx.length;
+  // 3b.1 此时目的 IP 地址不是路由器本身，则调用你编写的 query 函数查询，
+  //      如果查到目的地址，如果是直连路由， nexthop 改为目的 IP 地址，
+  //      用 HAL_ArpGetMacAddress 获取 nexthop 的 MAC 地址，
+  // beware of endianness
+  uint32_t nexthop, dest_if, nexthop_id;
+  if (query_id(dst_addr, &nexthop, &dest_if, &nexthop_id)) {
+    // found
+    // direct routing
+    const Adjacency *adj;
+    if (nexthop == 0) {
+      nexthop = dst_addr;
+      adj = getHostAdjacency(nexthop, dest_if, time);
+    } else {
+      adj = getAdjacency(nexthop_id, nexthop, dest_if, time);
+    }
+    // 调用你编写的 forward 函数进行 TTL 和 Checksum 的更新，
+    // 在 TTL 减到 0 的时候建议构造一个 ICMP Time Exceeded 返回给发送者；
+    uint8_t ttl = packet[8];
+    // update ttl and checksum in the borrowed buffer
+    if (!forwardFast(packet, packet_len)) {
+      printf("forwarding checksum failed.\n");
+      return false;
+    }
+    if (ttl == 0) {
+      // TODO: send a ICMP Time Exceeded to sender
+      // printf("ICMP TllE\n");
+    } else if (adj) {
+      // 如果找到了下一跳的 MAC 地址，通过 HAL_SendIPPacket 发到指定的网口，
+      // the cached L2 header goes right in front of the packet
+      memcpy(packet - adj->header_len, adj->header, adj->header_len);
+      // the packet is back with the HAL even if it could not be queued
+      if (HAL_QueueBorrowedPacket(dest_if, &rx, adj->header_len) != 0) {
+        tx_dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      // printf("forwarded.\n");
+    } else {
+      // 如果没查到下一跳的 MAC 地址，HAL 会自动发出 ARP 请求，
+      // 报文先暂存在 HAL 中，在对方回复后一起发出；暂存满了就只能丢弃
+      HAL_HoldIPPacket(dest_if, nexthop, packet, packet_len);
+    }
+  } else {
+    // TODO not found
+    // 如果没查到目的地址的路由，建议返回一个 ICMP Destination Network Unreachable
+    // printf("ICMP Destination Network Unreachable\n");
+  } // query
+  return true;
+}
+
+// workers 1 and up only forward, the HAL never gives them packets for the
+// router itself. A worker never gives up: the HAL keeps handing it its
+// share of the flows, and nobody else would take them
+static void forwardWorker(int worker) {
+  int res = HAL_SetWorker(worker);
+  assert(res == 0);
+  HAL_BorrowedPacket burst[BURST_SIZE];
+  int len = 0;
+  while (1) {
+    HAL_FlushSendQueues();
+    for (int i = 0; i < len; i++) {
+      if (burst[i].buffer) {
+        HAL_ReleaseBorrowedPacket(&burst[i]);
+      }
+    }
+    int mask = (1 << N_IFACE_ON_BOARD) - 1;
+    len = HAL_BorrowIPPacketBatch(mask, burst, BURST_SIZE, 1000);
+    if (len < 0) {
+      printf("worker %d: listen: error %d\n", worker, len);
+      len = 0;
+      std::this_thread::sleep_for(std::chrono::milliseconds(CONTROL_POLL_MS));
+      continue;
+    }
+    uint64_t time = HAL_GetTicks();
+    for (int i = 0; i < len; i++) {
+      uint8_t *packet = burst[i].buffer;
+      if (!validateIPChecksum(packet, burst[i].length)) {
+        printf("\033[31mInvalid IP Checksum\033[0m\n");
+        continue;
+      }
+      in_addr_t dst_addr;
+      memcpy(&dst_addr, &packet[16], sizeof(in_addr_t));
+      // a packet that could not be forwarded goes back with the burst
+      forwardPacket(burst[i], dst_addr, time);
+    }
+  }
+}
 
 int main(int argc, char *argv[]) {
   // 0a. 初始化 HAL，打开调试信息
+  int workers = FORWARD_WORKERS;
+  if (HAL_SetWorkerCount(workers) != 0) {
+    printf("%d forwarding workers not supported, using 1\n", workers);
+    workers = 1;
+  }
   int res = HAL_Init(1, addrs); 
   if (res < 0) {
     return res;
   }
+  for (int w = 1; w < workers; w++) {
+    std::thread(forwardWorker, w).detach();
+  }
   
   // 0b. 创建若干条 /24 直连路由
   for (uint32_t i = 0; i < N_IFACE_ON_BOARD; i++) {
@@ -61,82 +498,71 @@ int main(int argc, char *argv[]) {
     };
     update(true, entry);
   }
+  // from here on only the control thread changes the routing table
+  std::thread control(controlMain);
+  // the control thread wakes us up when it has something to send, unless
+  // the HAL cannot do that (this first wake only ends the first wait early)
+  const int receive_timeout =
+      HAL_WakeWorker(0) == 0 ? RECEIVE_TIMEOUT_MS : CONTROL_POLL_MS;
 
   uint64_t last_time = 0;
   while (1) {
-    // 获取当前时间，处理定时任务
     uint64_t time = HAL_GetTicks();
     if (time > last_time + 5 * 1000) {
-      // 每 30s 做什么
-      // 例如：超时？发 RIP Request/Response
-      printf("\033[33mTimer Event\033[0m\n");
       last_time = time;
-
-      // multicast response to all neighbors:
-      RipPacket rip;
-      for (int if_index = 0; if_index < N_IFACE_ON_BOARD; ++if_index) {
-        // fill resp with all route entries:
-        int idx_in_rt = 0;
-        do {
-          rip.command = CMD_RESPONSE;
-          uint32_t entries_to_send = routing_table.size() - idx_in_rt;
-          entries_to_send = std::min(entries_to_send, (uint32_t)RIP_MAX_ENTRY);
-          rip.numEntries = 0;
-          for (int i = 0; i < entries_to_send; ++i) {
-            const RoutingTableEntry &rte = routing_table.at(idx_in_rt + i);
-            if (rte.if_index == if_index) continue; // TODO nexthop | addr
-            rip.entries[rip.numEntries++] = rtEntry2RipEntry(rte);
-          }
-          // assemble rip packet
-          uint32_t rip_len = assemble(&rip, &output[20 + 8]);
-          // multicast through all ifs
-          
-          // assemble ip & udp head
-          uint32_t tot_len = writeIpUdpHead(output, rip_len, addrs[if_index], MULTICAST_ADDR);
-          macaddr_t multicast_mac;
-          res = HAL_ArpGetMacAddress(if_index, MULTICAST_ADDR, multicast_mac);
-          assert(res == 0);
-          res = HAL_SendIPPacket(if_index, output, tot_len, multicast_mac);
-          // printf("if_id = %u, res = %d, idx_in_rt = %d\n", if_index, res, idx_in_rt);
-          assert(res == 0);
-          
-          idx_in_rt += entries_to_send;
-        } while (idx_in_rt < routing_table.size()); // possibly send multiple times
-      } // for if_index
-      // printf("multicast done.\n");
-      printRoutingTable();
+      // receive queues, with HAL_RX_THREADS
+      for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+        HAL_RxQueueStats stats;
+        if (HAL_GetRxQueueStats(i, &stats) == 0) {
+          printf("rx queue %d: %u/%u waiting, high water %u, %llu dropped\n", i,
+                 stats.depth, stats.size, stats.high_water,
+                 (unsigned long long)stats.drops);
+        }
+      }
+      uint64_t dropped = tx_dropped.load(std::memory_order_relaxed);
+      if (dropped > 0) {
+        printf("tx: %llu dropped\n", (unsigned long long)dropped);
+      }
     }
 
-    int mask = (1 << N_IFACE_ON_BOARD) - 1; // listen for all interfaces
-    macaddr_t src_mac;
-    macaddr_t dst_mac;
-    int if_index;
-
-    res = HAL_ReceiveIPPacket(mask, packet, sizeof(packet), src_mac, dst_mac, 1000, &if_index);
-    if (res == HAL_ERR_EOF) {
-      printf("EOF\n");
-      break;
-    } else if (res < 0) {
-      printf("listen: error\n");
-      return res;
-    } else if (res == 0) {
-      // printf("listen: timeout\n");
-      continue;
-    } else if (res > sizeof(packet)) {
-      // packet is truncated, ignore it
-      printf("listen: truncated\n");
+    if (burst_pos == burst_len) {
+      sendControlPackets();
+      // everything forwarded from the last burst goes out before we wait
+      HAL_FlushSendQueues();
+      // and whatever was not forwarded goes back to the HAL
+      for (int i = 0; i < burst_len; i++) {
+        if (rx_burst[i].buffer) {
+          HAL_ReleaseBorrowedPacket(&rx_burst[i]);
+        }
+      }
+      burst_len = burst_pos = 0;
+      int mask = (1 << N_IFACE_ON_BOARD) - 1; // listen for all interfaces
+      res = HAL_BorrowIPPacketBatch(mask, rx_burst, BURST_SIZE, receive_timeout);
+      if (res == HAL_ERR_EOF) {
+        printf("EOF\n");
+        res = 0;
+        break;
+      } else if (res < 0) {
+        printf("listen: error\n");
+        break;
+      }
+      // res == 0: timeout, go back to the timer
+      burst_len = res;
+      burst_pos = 0;
       continue;
     }
-    // res > 0: ok
-    auto packet_len = res;
+    HAL_BorrowedPacket &rx = rx_burst[burst_pos++];
+    uint8_t *packet = rx.buffer;
+    uint8_t *src_mac = rx.src_mac;
+    int if_index = rx.if_index;
+    auto packet_len = rx.length;
     // 1. 检查是否是合法的 IP 包，可以用你编写的 validateIPChecksum 函数，还需要一些额外的检查
     if (!validateIPChecksum(packet, packet_len)) {
       printf("\033[31mInvalid IP Checksum\033[0m\n");
       continue;
     }
-    in_addr_t src_addr, dst_addr;
-    // extract src_addr and dst_addr from packet
-    src_addr = packet[12] + (packet[13] << 8) + (packet[14] << 16) + (packet[15] << 24); // big
+    in_addr_t dst_addr;
+    // extract dst_addr from packet
     dst_addr = packet[16] + (packet[17] << 8) + (packet[18] << 16) + (packet[19] << 24); // big
     // printf("learned an IP packet, src: %u.%u.%u.%u  dst: %u.%u.%u.%u\n", 
     //       packet[12], packet[13], packet[14], packet[15], 
@@ -156,176 +582,40 @@ int main(int argc, char *argv[]) {
       dst_is_me = true;
     }
 
-    if (dst_is_me) { // 3a
-      // printf("dst is me\n");
-      RipPacket rip;
-      // is this packet a RIP?
-      if (disassemble(packet, packet_len, &rip)) {
-        if (rip.command == CMD_REQUEST) {
-          // 3a.3 如果是 Request 包，就遍历本地的路由表，构造出一个 RipPacket 结构体，
-          //      然后调用你编写的 assemble 函数，另外再把 IP 和 UDP 头补充在前面，
-          //      通过 HAL_SendIPPacket 发回询问的网口
-          RipPacket resp;
-          // fill resp with all route entries
-          int idx_in_rt = 0;
-          do {
-            uint32_t entries_to_send = routing_table.size() - idx_in_rt;
-            resp.numEntries = std::min(entries_to_send, (uint32_t)RIP_MAX_ENTRY);
-            resp.command = CMD_RESPONSE;
-            for (int i = 0; i < resp.numEntries; ++i) {
-              resp.entries[i] = rtEntry2RipEntry(routing_table[idx_in_rt + i]); // TODO use [i]
-            }
-            // assemble rip packet
-            uint32_t rip_len = assemble(&rip, &output[20 + 8]);
-            // assemble ip & udp head
-            uint32_t tot_len = writeIpUdpHead(output, rip_len, dst_addr, src_addr);
-            // send it back
-            res = HAL_SendIPPacket(if_index, output, tot_len, src_mac);
-            assert(res == 0);
-
-            idx_in_rt += resp.numEntries;
-          } while (idx_in_rt < routing_table.size()); // possibly send multiple times
-        } else {
-          // 3a.2 如果是 Response 包，就调用你编写的 query 和 update 函数进行查询和更新，
-          //      注意此时的 RoutingTableEntry 可能要添加新的字段（如metric、timestamp），
-          //      如果有路由更新的情况，可能需要构造出 RipPacket 结构体，调用你编写的 assemble 函数，
-          //      再把 IP 和 UDP 头补充在前面，通过 HAL_SendIPPacket 把它发到别的网口上
-          // use query and update
-
-          // printf("got response packet\n");
-          bool did_update_rt = false;
-          for (int i = 0; i < rip.numEntries; ++i) {
-            const RipEntry &rpe = rip.entries[i];
-            // printf("\033[31mrpe ip: %u.%u.%u.%u\033[0m\n", (uint8_t)rpe.addr, (uint8_t)(rpe.addr>>8), (uint8_t)(rpe.addr>>16), (uint8_t)(rpe.addr>>24));
-            uint8_t metric = (uint8_t)endianSwap(rpe.metric);
-            if (metric + 1 > 16) {
-              // deleting this route entry ?
-              bool is_direct = false;
-              for (int i = 0; i < N_IFACE_ON_BOARD; ++i) {
-                if ((rpe.addr & rpe.mask) == (addrs[i] & 0x00ffffff)) {
-                  is_direct = true;
-                  break;
-                }
-              }
-              if (is_direct) {
-                // printf("protect direct routing\n");
-                continue; // protect direct routing
-              }
-              auto rte = RipEntry2rtEntry(rpe);
-              auto where = find(rte);
-              if (where == routing_table.end()) {
-                // printf("Fail to delete in routing table, the entry is not found.");
-                // printf("ip: %u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
-                continue;
-              }
-              if (where->if_index != if_index) {
-                // printf("protect route entry for if_index not match\n");
-                continue;
-              }
-              // printf("\033[32mdeleting route entry: \033[0m");
-              // printf("%u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
-              did_update_rt = true;
-              routing_table.erase(where);
-              RipPacket resp; // construct expire packet
-              resp.command = CMD_RESPONSE;
-              resp.numEntries = 1;
-              resp.entries[0] = rpe;
-              auto rip_len = assemble(&resp, &output[20 + 8]);
-              // multicast expire packet to all if except in_if
-              // for (int out_if = 0; out_if < N_IFACE_ON_BOARD; ++out_if) {
-              //   if (out_if == if_index) continue; // avoid sending back
-              //   auto tot_len = writeIpUdpHead(output, rip_len, addrs[out_if], MULTICAST_ADDR);
-              //   macaddr_t multicast_mac;
-              //   res = HAL_ArpGetMacAddress(out_if, MULTICAST_ADDR, multicast_mac);
-              //   assert(res == 0);
-              //   res = HAL_SendIPPacket(out_if, output, tot_len, multicast_mac);
-              //   assert(res == 0);
-              //   printf("expire packet sent to %d\n", out_if);
-              // }
-            } else {
-              // insert / update?
-              RoutingTableEntry rte = {
-                .addr = rpe.addr,
-                .len = maskToLen(rpe.mask),
-                .if_index = (uint32_t)if_index,
-                .nexthop = src_addr,
-                .metric = (uint8_t)(endianSwap(rpe.metric) + 1u)
-              };
-              auto where = find(rte);
-              if (where == routing_table.end()) {
-                // not found, insert
-                did_update_rt = true;
-                // printf("\033[32minserting route entry: \033[0m");
-                // printf("%u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
-                routing_table.push_back(rte);
-              } else {
-                // found the same route
-                if (metric + 1 <= where->metric) {
-                  // update
-                  did_update_rt = true;
-                  // printf("\033[32mupdating route entry: \033[0m");
-                  // printf("%u.%u.%u.%u/%u \n", (uint8_t)rte.addr, (uint8_t)(rte.addr>>8), (uint8_t)(rte.addr>>16), (uint8_t)(rte.addr>>24), rte.len);
-                  *where = rte;
-                  // wait until next periodical multicast
-                  // or incrementally multicast now
-                }
-                // else: no op
-              }
-            }
-          }
-          // if (did_update_rt) {
-          //   printf("\033[32mupdated routing table\n");
-          //   printRoutingTable();
-          //   printf("\033[0m");
-          // }
+    if (dst_is_me) { // 3a, on the control thread
+      // only UDP can be RIP
+      if (packet[9] == 17 && packet_len <= CONTROL_PACKET_MAX) {
+        control_in.if_index = if_index;
+        memcpy(control_in.mac, src_mac, sizeof(macaddr_t));
+        control_in.length = packet_len;
+        memcpy(&control_in.buffer[HAL_L2_HEADER_MAX], packet, packet_len);
+        // dropped if the control thread is that far behind
+        if (spscPush(to_control, control_in)) {
+          controlNotify();
         }
-      } else { // if not a valid rip, ignore
-        // printf("not a valid rip\n");
       }
     } else {
       // printf("forwarding\n");
-      // 3b.1 此时目的 IP 地址不是路由器本身，则调用你编写的 query 函数查询，
-      //      如果查到目的地址，如果是直连路由， nexthop 改为目的 IP 地址，
-      //      用 HAL_ArpGetMacAddress 获取 nexthop 的 MAC 地址，
-      // beware of endianness
-      uint32_t nexthop, dest_if;
-      if (query(dst_addr, &nexthop, &dest_if)) {
-        // found
-        macaddr_t dest_mac;
-        // direct routing
-        if (nexthop == 0) {
-          nexthop = dst_addr;
-        }
-        if (HAL_ArpGetMacAddress(dest_if, nexthop, dest_mac) == 0) {
-          // 如果找到了，就调用你编写的 forward 函数进行 TTL 和 Checksum 的更新，
-          // 通过 HAL_SendIPPacket 发到指定的网口，
-          // 在 TTL 减到 0 的时候建议构造一个 ICMP Time Exceeded 返回给发送者；
-          memcpy(output, packet, packet_len);
-          // update ttl and checksum
-          if (!forwardFast(output, packet_len)) {
-            printf("forwarding checksum failed.\n");
-            break;
-          }
-          if (packet[8] == 0) { // if ttl == 0
-            // TODO: send a ICMP Time Exceeded to sender
-            // printf("ICMP TllE\n");
-          } else {
-            res = HAL_SendIPPacket(dest_if, output, packet_len, dest_mac);
-            assert(res == 0);
-            // printf("forwarded.\n");
-          }
-        } else {
-          // 如果没查到下一跳的 MAC 地址，HAL 会自动发出 ARP 请求，在对方回复后，下次转发时就知道了
-        }
-      } else {
-        // TODO not found
-        // 如果没查到目的地址的路由，建议返回一个 ICMP Destination Network Unreachable
-        // printf("ICMP Destination Network Unreachable\n");
-      } // query
+      if (!forwardPacket(rx, dst_addr, time)) {
+        break;
+      }
 
     } // if dst_is_me
 
   } // while 1
 
-  return 0;
+  // let the control thread finish what it has been given, and keep sending
+  // its answers until it is done: it waits for us while from_control is full
+  control_stop = true;
+  controlNotify();
+  while (!control_done) {
+    sendControlPackets();
+    HAL_FlushSendQueues();
+    std::unique_lock<std::mutex> lock(control_lock);
+    control_wake.wait(lock, [] { return control_done.load() || !spscEmpty(from_control); });
+  }
+  control.join();
+  sendControlPackets();
+  HAL_FlushSendQueues();
+  return res < 0 ? res : 0;
 } // main
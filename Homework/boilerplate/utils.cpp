@@ -1,28 +1,13 @@
 #include "utils.h"
 #include "router_hal.h"
 #include "router.h"
+#include "router_checksum.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <vector>
 
-static uint16_t valSum(const uint8_t *packet, size_t len) {
-  uint32_t sum = 0;
-  uint32_t overflow = 0;
-  for (size_t i = 0; i < len; i += 2) { // step 2 uint_8s
-    sum += (packet[i] << 8) + packet[i+1];
-    do {
-      overflow = (sum & 0xFFFF0000) >> 16; // take hi 16 bits of sum
-      sum &= 0x0000FFFF;  // trunc to lo 16 bits
-      sum += overflow;
-    } while (overflow != 0);
-  }
-  sum = ~sum & 0x0000FFFF; // logical not
-
-  return sum;
-}
-
 RipEntry rtEntry2RipEntry(const RoutingTableEntry &e) {
   return RipEntry{
     .addr = e.addr,
@@ -63,7 +48,10 @@ uint32_t endianSwap(uint32_t a) {
 }
 
 // assuming the `buffer`'s body has already been assembled, return the total len = head + body
-uint32_t writeIpUdpHead(uint8_t *buffer, uint32_t body_len, uint32_t src_addr, uint32_t dst_addr) {
+// `buffer` is where the IP header goes; leave HAL_L2_HEADER_MAX bytes in front of
+// it to send the result with HAL_SendIPPacketInPlace
+// body_sum is the unfolded checksum of the body, as returned by assemble()
+uint32_t writeIpUdpHead(uint8_t *buffer, uint32_t body_len, uint32_t src_addr, uint32_t dst_addr, uint64_t body_sum) {
   /**
    * 代码中在发送 RIP 包的时候，会涉及到 IP 头的构造，由于不需要用各种高级特性，
    * 可以这么设定：V=4，IHL=5，TOS(DSCP/ECN)=0，ID=0，FLAGS/OFF=0，
@@ -80,16 +68,22 @@ uint32_t writeIpUdpHead(uint8_t *buffer, uint32_t body_len, uint32_t src_addr, u
   buffer[10] = 0, buffer[11] = 0; // checksum
   memcpy(&buffer[12], &src_addr, sizeof(src_addr)); // src ip
   memcpy(&buffer[16], &dst_addr, sizeof(dst_addr)); // dst_ip
-  uint16_t checksum = valSum(buffer, 20);
-  buffer[10] = (uint8_t)(checksum >> 8), buffer[11] = (uint8_t)checksum; // checksum
+  uint16_t ip_sum = checksum(buffer, 20);
+  buffer[10] = (uint8_t)(ip_sum >> 8), buffer[11] = (uint8_t)ip_sum; // checksum
   // UDP
   // port = 520
   buffer[20] = 0x02, buffer[21] = 0x08; // src 520
   buffer[22] = 0x02, buffer[23] = 0x08; // dst 520
   buffer[24] = (uint8_t)((8 + body_len)>>8), buffer[25] = (uint8_t)(8 + body_len); // length
-  // checksum = valSum(&buffer[20], 8);
-  // buffer[26] = (uint8_t)(checksum >> 8), buffer[27] = (uint8_t)checksum; // checksum
   buffer[26] = 0, buffer[27] = 0; // checksum
+  // pseudo header (src, dst, zero, protocol, udp length) + udp head + body
+  const uint8_t pseudo[4] = {0, buffer[9], buffer[24], buffer[25]};
+  uint64_t sum = checksumPartial(&buffer[12], 8, body_sum);
+  sum = checksumPartial(pseudo, sizeof(pseudo), sum);
+  sum = checksumPartial(&buffer[20], 8, sum);
+  uint16_t udp_sum = ~checksumFold(sum);
+  if (udp_sum == 0) udp_sum = 0xFFFF; // 0 means no checksum in udp
+  buffer[26] = (uint8_t)(udp_sum >> 8), buffer[27] = (uint8_t)udp_sum; // checksum
   
   return tot_len;
 }
@@ -110,5 +104,5 @@ void printRoutingTable() {
 // uint32_t writeIcmpTllE(uint8_t *buffer) { // Tll exceed
 //     buffer[0] = 11; // type
 //     buffer[1] = 0; // code
-//     // valSum
+//     // checksum
 // }
@@ -10,7 +10,7 @@ RoutingTableEntry RipEntry2rtEntry(const RipEntry &e);
 uint32_t lenToMask(uint32_t len);
 uint32_t maskToLen(uint32_t mask);
 uint32_t endianSwap(uint32_t a);
-uint32_t writeIpUdpHead(uint8_t *buffer, uint32_t body_len, uint32_t src_addr, uint32_t dst_addr);
+uint32_t writeIpUdpHead(uint8_t *buffer, uint32_t body_len, uint32_t src_addr, uint32_t dst_addr, uint64_t body_sum);
 void printRoutingTable();
 
 #endif
@@ -1,5 +1,7 @@
+#include "router_checksum.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cstdio>
 
 static void printByte(uint8_t a)
@@ -10,8 +12,6 @@ static void printByte(uint8_t a)
 	}
 }
 
-static uint32_t sum_cache = 0; // checksum of the whole ip head but ttl (packet[8])
-
 /**
  * @brief 进行 IP 头的校验和的验证
  * @param packet 完整的 IP 头和载荷
@@ -19,41 +19,16 @@ static uint32_t sum_cache = 0; // checksum of the whole ip head but ttl (packet[
  * @return 校验和无误则返回 true ，有误则返回 false
  */
 bool validateIPChecksum(uint8_t *packet, size_t len) {
-  // 1. zerolize cheksum area
   uint16_t expected = (packet[10] << 8) + packet[11];
-  packet[10] = 0;
-  packet[11] = 0;
   // get IP header length
   size_t h_len = (packet[0] & 0b00001111) * 4;  // in byte
-  // 2. suming up all 16-bit
-  uint32_t sum = 0;
-  uint32_t overflow = 0;
-
-  uint8_t ttl = packet[8]; // backup ttl
-  packet[8] = 0;
-  #pragma unroll
-  for (size_t i = 0; i < h_len; i += 2) { // step 2 uint_8s
-    sum += (packet[i] << 8) + packet[i+1];
-    do {
-      overflow = (sum & 0xFFFF0000) >> 16; // take hi 16 bits of sum
-      sum &= 0x0000FFFF;  // trunc to lo 16 bits
-      sum += overflow;
-    } while (overflow != 0);
-  }
-  sum_cache = sum;  // cache for forwarding
-  packet[8] = ttl;  // recover ttl
-  sum += (ttl << 8);
-  do {
-    overflow = (sum & 0xFFFF0000) >> 16; // take hi 16 bits of sum
-    sum &= 0x0000FFFF;  // trunc to lo 16 bits
-    sum += overflow;
-  } while (overflow != 0);
+  // sum the whole header, then take the checksum field back out
+  uint64_t sum = checksumPartial(packet, h_len, 0);
+  uint16_t field;
+  memcpy(&field, &packet[10], sizeof(field));
+  sum -= field;
 
-  sum = ~sum & 0x0000FFFF; // logical not
-  packet[10] = (uint8_t)(expected >> 8);
-  packet[11] = (uint8_t)(expected);
-
-  return sum == expected;
+  return (uint16_t)~checksumFold(sum) == expected;
 }
 
 /**
@@ -66,24 +41,17 @@ bool validateIPChecksum(uint8_t *packet, size_t len) {
  * @return 校验和无误则返回 true ，有误则返回 false
  */
 bool forwardFast(uint8_t *packet, size_t len) {
-  uint16_t exp_sum = (packet[10] << 8) + packet[11];
-  // packet[10] = 0;
-  // packet[11] = 0;
-  // get IP header length
-  size_t h_len = (packet[0] & 0x0F) * 4;  // in byte
-  // 1. check valsum (not necessary actually)
-  // if (valSum(packet, h_len) != exp_sum) return false;
-  // 2. ttl -= 1
+  // incremental update (RFC 1624): HC' = ~(~HC + ~m + m'),
+  // m is the 16-bit word holding TTL, so only bytes 8, 10 and 11 are written
+  uint16_t old_word = (packet[8] << 8) + packet[9];
+  // 1. ttl -= 1
   packet[8] -= 1;
-  // 3. update valsum
-  // uint16_t val_sum = valSum(packet, h_len);
-  uint32_t sum = sum_cache, overflow;
-  sum += (packet[8] << 8);
-  do {
-    overflow = (sum & 0xFFFF0000) >> 16; // take hi 16 bits of sum
-    sum &= 0x0000FFFF;  // trunc to lo 16 bits
-    sum += overflow;
-  } while (overflow != 0);
+  uint16_t new_word = (packet[8] << 8) + packet[9];
+  // 2. update valsum
+  uint16_t old_sum = (packet[10] << 8) + packet[11];
+  uint32_t sum = (uint16_t)~old_sum + (uint16_t)~old_word + new_word;
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
   sum = ~sum & 0x0000FFFF; // logical not
 
   packet[10] = sum >> 8;
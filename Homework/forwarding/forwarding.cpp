@@ -1,3 +1,4 @@
+#include "router_checksum.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <cstdio>
@@ -10,22 +11,6 @@ static void printByte(uint8_t a)
 	}
 }
 
-uint16_t valSum(const uint8_t *packet, size_t len) {
-  uint32_t sum = 0;
-  uint32_t overflow = 0;
-  for (size_t i = 0; i < len; i += 2) { // step 2 uint_8s
-    sum += (packet[i] << 8) + packet[i+1];
-    do {
-      overflow = (sum & 0xFFFF0000) >> 16; // take hi 16 bits of sum
-      sum &= 0x0000FFFF;  // trunc to lo 16 bits
-      sum += overflow;
-    } while (overflow != 0);
-  }
-  sum = ~sum & 0x0000FFFF; // logical not
-
-  return sum;
-}
-
 /**
  * @brief 进行转发时所需的 IP 头的更新：
  *        你需要先检查 IP 头校验和的正确性，如果不正确，直接返回 false ；
@@ -42,12 +27,12 @@ bool forward(uint8_t *packet, size_t len) {
   // get IP header length
   size_t h_len = (packet[0] & 0x0F) * 4;  // in byte
   // 1. check valsum (not necessary actually)
-  // if (valSum(packet, h_len) != exp_sum) return false;
+  // if (checksum(packet, h_len) != exp_sum) return false;
   // 2. ttl -= 1
   packet[8] -= 1;
   // 3. update valsum
   
-  uint16_t val_sum = valSum(packet, h_len);
+  uint16_t val_sum = checksum(packet, h_len);
   // reinterpret_cast<uint16_t&>(packet[10]) = val_sum;
   packet[10] = val_sum >> 8;
   packet[11] = val_sum;
@@ -0,0 +1,213 @@
+#include "router_hal.h"
+#include "router.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+// lookup microbenchmark: loads a synthetic table with an Internet-like
+// prefix length distribution, then runs uniform and Zipf query streams
+// usage: bench [-n prefixes] [-q queries] [-u updates] [-z zipf_s] [-s seed]
+
+extern void update(bool insert, RoutingTableEntry entry);
+extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+extern void query_batch(const uint32_t *addrs, size_t n, uint32_t *nexthops, uint32_t *if_indexes, bool *found);
+
+typedef std::chrono::steady_clock bench_clock;
+
+// rough share of each prefix length in a full BGP table, in permille
+static const struct {
+  uint32_t len;
+  uint32_t weight;
+} len_dist[] = {
+  {8, 1},   {10, 1},   {11, 1},  {12, 2},  {13, 3},  {14, 5},  {15, 7},
+  {16, 20}, {17, 11},  {18, 18}, {19, 30}, {20, 45}, {21, 50}, {22, 100},
+  {23, 90}, {24, 600}, {25, 4},  {26, 4},  {27, 3},  {28, 2},  {29, 1},
+  {30, 1},  {32, 1},
+};
+
+const size_t SAMPLE = 16; // lookups per latency sample
+const size_t BATCH = 64;  // addresses per query_batch() call
+const uint32_t NEIGHBORS = 64;
+
+static std::mt19937 rng;
+
+static double seconds(bench_clock::time_point a, bench_clock::time_point b) {
+  return std::chrono::duration<double>(b - a).count();
+}
+
+static long rssKb() {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f) {
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    if (kb >= 0) return kb;
+  }
+  // no procfs, fall back to the peak
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+static uint32_t randomLen() {
+  static std::discrete_distribution<int> dist = [] {
+    std::vector<double> w;
+    for (auto &d : len_dist) w.push_back(d.weight);
+    return std::discrete_distribution<int>(w.begin(), w.end());
+  }();
+  return len_dist[dist(rng)].len;
+}
+
+static RoutingTableEntry randomRoute(uint32_t len) {
+  uint32_t mask = len ? 0xFFFFFFFF << (32 - len) : 0;
+  // keep clear of 0/8, multicast and above
+  uint32_t host = ((rng() % 223 + 1) << 24 | (rng() & 0x00FFFFFF)) & mask;
+  uint32_t neighbor = rng() % NEIGHBORS;
+  RoutingTableEntry entry = {
+    .addr = htonl(host),
+    .len = len,
+    .if_index = neighbor % N_IFACE_ON_BOARD,
+    .nexthop = htonl(0x0A000001 + neighbor),
+    .metric = 1,
+    .timestamp = 0
+  };
+  return entry;
+}
+
+// an address inside the prefix
+static uint32_t addrIn(const RoutingTableEntry &e) {
+  uint32_t host_bits = e.len == 32 ? 0 : (rng() & (0xFFFFFFFF >> e.len));
+  return e.addr | htonl(host_bits);
+}
+
+static void report(const char *name, size_t n, double secs, std::vector<double> &samples) {
+  std::sort(samples.begin(), samples.end());
+  auto pct = [&](double p) { return samples[(size_t)(p * (samples.size() - 1))]; };
+  printf("%-14s %10.2f Mlookups/s  ns/lookup p50 %6.1f  p90 %6.1f  p99 %6.1f  p99.9 %6.1f\n",
+         name, n / secs / 1e6, pct(0.5), pct(0.9), pct(0.99), pct(0.999));
+}
+
+static void runQueries(const char *name, const std::vector<uint32_t> &addrs) {
+  uint32_t nexthop, if_index, sink = 0;
+  size_t n = addrs.size() / SAMPLE * SAMPLE;
+  std::vector<double> samples;
+  samples.reserve(n / SAMPLE);
+  // throughput and latency are taken from the same run; each sample times
+  // SAMPLE back to back lookups so the clock overhead stays small
+  auto begin = bench_clock::now();
+  auto last = begin;
+  for (size_t i = 0; i < n; i += SAMPLE) {
+    for (size_t j = i; j < i + SAMPLE; j++) {
+      if (query(addrs[j], &nexthop, &if_index)) sink += nexthop;
+    }
+    auto now = bench_clock::now();
+    samples.push_back(std::chrono::duration<double, std::nano>(now - last).count() / SAMPLE);
+    last = now;
+  }
+  report(name, n, seconds(begin, last), samples);
+
+  std::vector<uint32_t> nexthops(BATCH), if_indexes(BATCH);
+  bool found[BATCH];
+  samples.clear();
+  n = addrs.size() / BATCH * BATCH;
+  begin = last = bench_clock::now();
+  for (size_t i = 0; i < n; i += BATCH) {
+    query_batch(&addrs[i], BATCH, nexthops.data(), if_indexes.data(), found);
+    sink += nexthops[0];
+    auto now = bench_clock::now();
+    samples.push_back(std::chrono::duration<double, std::nano>(now - last).count() / BATCH);
+    last = now;
+  }
+  char batch_name[32];
+  snprintf(batch_name, sizeof(batch_name), "%s/batch", name);
+  report(batch_name, n, seconds(begin, last), samples);
+  if (sink == 0x5A5A5A5A) printf("\n"); // keep the lookups alive
+}
+
+int main(int argc, char *argv[]) {
+  size_t n_prefixes = 100000, n_queries = 10000000, n_updates = 100000;
+  double zipf_s = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:q:u:z:s:")) != -1) {
+    switch (opt) {
+    case 'n': n_prefixes = strtoul(optarg, NULL, 0); break;
+    case 'q': n_queries = strtoul(optarg, NULL, 0); break;
+    case 'u': n_updates = strtoul(optarg, NULL, 0); break;
+    case 'z': zipf_s = atof(optarg); break;
+    case 's': rng.seed(strtoul(optarg, NULL, 0)); break;
+    default:
+      fprintf(stderr, "usage: %s [-n prefixes] [-q queries] [-u updates] [-z zipf_s] [-s seed]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // 1. build the table, distinct (addr, len) only
+  std::vector<RoutingTableEntry> routes;
+  std::unordered_set<uint64_t> seen;
+  routes.reserve(n_prefixes);
+  while (routes.size() < n_prefixes) {
+    RoutingTableEntry e = randomRoute(randomLen());
+    if (seen.insert((uint64_t)e.len << 32 | e.addr).second) routes.push_back(e);
+  }
+
+  long rss_before = rssKb();
+  auto begin = bench_clock::now();
+  for (auto &e : routes) update(true, e);
+  double load = seconds(begin, bench_clock::now());
+  long rss_after = rssKb();
+  printf("prefixes       %zu\n", routes.size());
+  printf("load           %10.2f Minserts/s\n", routes.size() / load / 1e6);
+  printf("memory         %ld kB RSS (%+ld kB for the table)\n", rss_after, rss_after - rss_before);
+
+  // 2. churn: withdraw a random route and announce it again via another neighbor
+  std::uniform_int_distribution<size_t> pick(0, routes.size() - 1);
+  begin = bench_clock::now();
+  for (size_t i = 0; i < n_updates; i++) {
+    RoutingTableEntry &e = routes[pick(rng)];
+    update(false, e);
+    uint32_t neighbor = rng() % NEIGHBORS;
+    e.if_index = neighbor % N_IFACE_ON_BOARD;
+    e.nexthop = htonl(0x0A000001 + neighbor);
+    update(true, e);
+  }
+  double churn = seconds(begin, bench_clock::now());
+  printf("update         %10.2f Mupdates/s (delete + insert counted as 2)\n", 2 * n_updates / churn / 1e6);
+
+  // 3. queries: uniform over the address space, then Zipf over the prefixes
+  std::vector<uint32_t> addrs(n_queries);
+  for (auto &a : addrs) a = rng();
+  runQueries("uniform", addrs);
+
+  // rank r (0 based) is hit with probability proportional to 1 / (r + 1)^s
+  std::vector<double> cdf(routes.size());
+  double total = 0;
+  for (size_t r = 0; r < routes.size(); r++) {
+    total += 1.0 / pow(r + 1, zipf_s);
+    cdf[r] = total;
+  }
+  std::shuffle(routes.begin(), routes.end(), rng);
+  std::uniform_real_distribution<double> unit(0, total);
+  for (auto &a : addrs) {
+    size_t r = std::lower_bound(cdf.begin(), cdf.end(), unit(rng)) - cdf.begin();
+    a = addrIn(routes[std::min(r, routes.size() - 1)]);
+  }
+  char zipf_name[32];
+  snprintf(zipf_name, sizeof(zipf_name), "zipf(%.2g)", zipf_s);
+  runQueries(zipf_name, addrs);
+  return 0;
+}
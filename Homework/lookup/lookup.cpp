@@ -2,10 +2,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <vector>
+#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
 #include <cstdio>
 
+// RIB: every route RIP knows about, with its control plane state
 std::vector<RoutingTableEntry> routing_table;
+// exact match index: (addr, len) -> position in routing_table
+static std::unordered_map<uint64_t, uint32_t> route_index;
 
 /*
   RoutingTable Entry 的定义如下：
@@ -23,6 +30,318 @@ std::vector<RoutingTableEntry> routing_table;
   你可以在全局变量中把路由表以一定的数据结构格式保存下来。
 */
 
+template<typename T>
+static void showBits(T a)
+{
+	auto b = (T *) (&a);  // low bit at right
+	for (int k = 8 * sizeof(T) - 1; k >= 0; --k) {
+		printf("%u", (bool) (*b & (1 << k)));
+	}
+}
+
+inline static uint32_t endianSwap(uint32_t a) {
+  return (a >> 24) | ((a & 0x00FF0000) >> 8) | ((a & 0x0000FF00) << 8) | ((a & 0x000000FF) << 24);
+}
+
+// DIR-24-8 lookup engine
+// tbl24 is indexed by the high 24 bits of the (little endian) address,
+// /24s holding longer prefixes are expanded into a 256-entry group in tbl8.
+// entry layout: | valid:1 | ext:1 | depth:6 | nexthop id or tbl8 group:24 |
+#define FIB_VALID 0x80000000u
+#define FIB_EXT 0x40000000u
+#define FIB_DEPTH(e) (((e) >> 24) & 0x3F)
+#define FIB_DATA(e) ((e) & 0x00FFFFFF)
+#define FIB_ENTRY(depth, data) (FIB_VALID | ((uint32_t)(depth) << 24) | (data))
+
+static const uint32_t TBL8_GROUP_SIZE = 256;
+
+// one version of the forwarding table
+typedef struct {
+  uint32_t tbl24[1 << 24]; // 64MiB, in bss so untouched pages cost nothing
+  std::vector<uint32_t> tbl8;
+  std::vector<uint32_t> tbl8_free; // indices of released groups
+} Fib;
+
+// a change made to one version, replayed later on the other one
+typedef struct {
+  uint32_t prefix; // little endian
+  uint32_t len;
+  bool insert;
+  uint32_t ent;
+} FibOp;
+
+// RCU style versioning (left-right):
+// readers only ever see the version `fib_active` points to, which is never written.
+// update() writes the standby version, publishes it by swapping `fib_active`,
+// and brings the old version up to date with `fib_log` once no reader is left on it.
+// update() must not be called from two threads at the same time, query() may be
+// called from any number of threads concurrently with it.
+static Fib fibs[2];
+static std::atomic<Fib *> fib_active(&fibs[0]);
+static std::vector<FibOp> fib_log; // applied to the active version only
+
+// readers announce the epoch they entered at, 0 while outside
+struct alignas(64) FibReader {
+  std::atomic<uint64_t> epoch;
+  std::atomic<bool> used; // owned by a thread
+};
+
+// a thread takes a slot on its first lookup and gives it back when it exits;
+// threads that find none share the last one, one at a time
+static const int FIB_MAX_READERS = 64;
+static FibReader fib_readers[FIB_MAX_READERS + 1];
+static FibReader *const fib_shared_reader = &fib_readers[FIB_MAX_READERS];
+static std::mutex fib_shared_lock;
+static std::atomic<int> fib_reader_count(0); // slots ever taken are below this
+static std::atomic<uint64_t> fib_epoch(1);
+
+struct FibReaderSlot {
+  FibReader *reader = nullptr;
+  ~FibReaderSlot() {
+    if (reader) {
+      reader->used.store(false, std::memory_order_release);
+    }
+  }
+};
+static thread_local FibReaderSlot fib_reader_slot;
+
+// FIB routes only refer to a small id, the actual nexthop lives here
+typedef struct {
+  uint32_t nexthop;
+  uint32_t if_index;
+} NextHop;
+
+// fixed size so that readers never see it moving
+static NextHop nexthop_table[NEXTHOP_MAX];
+static uint32_t nexthop_ref[NEXTHOP_MAX]; // number of routes using it, 0 means free
+static uint32_t nexthop_used = 0;
+static std::unordered_map<uint64_t, uint32_t> nexthop_index; // (if_index, nexthop) -> id
+static std::vector<uint32_t> nexthop_free;
+static std::vector<uint32_t> nexthop_retired; // free, but old versions may still point at them
+
+// FIB: the best route of each prefix, as far as forwarding is concerned
+// (addr, len) -> entry, the lookup tables are derived from it
+static std::unordered_map<uint64_t, FibEntry> fib_routes;
+
+inline static uint64_t routeKey(uint32_t addr, uint32_t len) {
+  return ((uint64_t)len << 32) | addr;
+}
+
+inline static uint32_t hostMask(uint32_t len) {
+  return len == 0 ? 0 : 0xFFFFFFFF << (32 - len);
+}
+
+// nullptr if every slot is taken
+static FibReader *fibReaderClaim() {
+  for (int i = 0; i < FIB_MAX_READERS; ++i) {
+    bool used = false;
+    if (!fib_readers[i].used.load() &&
+        fib_readers[i].used.compare_exchange_strong(used, true)) {
+      int n = fib_reader_count.load();
+      while (n <= i && !fib_reader_count.compare_exchange_weak(n, i + 1)) {
+      }
+      return &fib_readers[i];
+    }
+  }
+  return nullptr;
+}
+
+static const Fib *fibReadLock() {
+  FibReader *reader = fib_reader_slot.reader;
+  if (reader == nullptr) {
+    reader = fib_reader_slot.reader = fibReaderClaim();
+  }
+  if (reader == nullptr) {
+    fib_shared_lock.lock();
+    reader = fib_shared_reader;
+  }
+  reader->epoch.store(fib_epoch.load());
+  return fib_active.load();
+}
+
+static void fibReadUnlock() {
+  FibReader *reader = fib_reader_slot.reader;
+  if (reader == nullptr) {
+    fib_shared_reader->epoch.store(0, std::memory_order_release);
+    fib_shared_lock.unlock();
+    return;
+  }
+  reader->epoch.store(0, std::memory_order_release);
+}
+
+// wait until every reader that might still hold the previous version has left
+static void fibSynchronize() {
+  uint64_t epoch = fib_epoch.fetch_add(1) + 1;
+  int n = std::min(fib_reader_count.load(), FIB_MAX_READERS);
+  for (int i = 0; i <= n; ++i) {
+    // the slots in use, then the shared one
+    FibReader &reader = i < n ? fib_readers[i] : *fib_shared_reader;
+    uint64_t e;
+    while ((e = reader.epoch.load()) != 0 && e < epoch) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// return NEXTHOP_MAX when the table is full
+static uint32_t nexthopAcquire(uint32_t nexthop, uint32_t if_index) {
+  uint64_t key = ((uint64_t)if_index << 32) | nexthop;
+  auto it = nexthop_index.find(key);
+  uint32_t id;
+  if (it != nexthop_index.end()) {
+    id = it->second;
+  } else {
+    if (!nexthop_free.empty()) {
+      id = nexthop_free.back();
+      nexthop_free.pop_back();
+    } else if (nexthop_used < NEXTHOP_MAX) {
+      id = nexthop_used++;
+    } else {
+      return NEXTHOP_MAX;
+    }
+    nexthop_table[id] = NextHop{nexthop, if_index};
+    nexthop_index[key] = id;
+  }
+  ++nexthop_ref[id];
+  return id;
+}
+
+static void nexthopRelease(uint32_t id) {
+  if (--nexthop_ref[id] == 0) {
+    const NextHop &nh = nexthop_table[id];
+    nexthop_index.erase(((uint64_t)nh.if_index << 32) | nh.nexthop);
+    nexthop_retired.push_back(id);
+  }
+}
+
+static uint32_t tbl8Alloc(Fib &fib, uint32_t fill) {
+  uint32_t group;
+  if (!fib.tbl8_free.empty()) {
+    group = fib.tbl8_free.back();
+    fib.tbl8_free.pop_back();
+  } else {
+    group = fib.tbl8.size() / TBL8_GROUP_SIZE;
+    fib.tbl8.resize(fib.tbl8.size() + TBL8_GROUP_SIZE);
+  }
+  std::fill_n(&fib.tbl8[group * TBL8_GROUP_SIZE], TBL8_GROUP_SIZE, fill);
+  return group;
+}
+
+// insert: take over every slot not covered by a longer prefix
+// delete: hand the slots owned by the deleted prefix (same depth) over to `ent`
+inline static void fibSlot(uint32_t &slot, uint32_t len, bool insert, uint32_t ent) {
+  if (insert ? (!(slot & FIB_VALID) || FIB_DEPTH(slot) <= len)
+             : ((slot & FIB_VALID) && FIB_DEPTH(slot) == len)) {
+    slot = ent;
+  }
+}
+
+// fold a group back into tbl24 once it no longer holds anything longer than /24
+static void tbl8TryCollapse(Fib &fib, uint32_t idx) {
+  uint32_t group = FIB_DATA(fib.tbl24[idx]);
+  const uint32_t *g = &fib.tbl8[group * TBL8_GROUP_SIZE];
+  uint32_t first = g[0];
+  if ((first & FIB_VALID) && FIB_DEPTH(first) > 24) return;
+  for (uint32_t i = 1; i < TBL8_GROUP_SIZE; ++i) {
+    if (g[i] != first) return;
+  }
+  fib.tbl24[idx] = first;
+  fib.tbl8_free.push_back(group);
+}
+
+/**
+ * @brief 把一条前缀写入某一版本的 DIR-24-8 表
+ * @param op.prefix 小端序的前缀
+ * @param op.len 前缀长度
+ * @param op.insert 插入时 ent 为该前缀的表项，删除时 ent 为替代它的（更短的）前缀的表项，可以为 0
+ *
+ * 结果只取决于 op 和 fib 原来的内容，所以同一串 op 在两个版本上重放后两者相同。
+ */
+static void fibApply(Fib &fib, const FibOp &op) {
+  uint32_t prefix = op.prefix & hostMask(op.len);
+  if (op.len <= 24) {
+    uint32_t begin = prefix >> 8, end = begin + (1u << (24 - op.len));
+    for (uint32_t idx = begin; idx < end; ++idx) {
+      if (fib.tbl24[idx] & FIB_EXT) {
+        uint32_t *g = &fib.tbl8[FIB_DATA(fib.tbl24[idx]) * TBL8_GROUP_SIZE];
+        for (uint32_t i = 0; i < TBL8_GROUP_SIZE; ++i) fibSlot(g[i], op.len, op.insert, op.ent);
+        if (!op.insert) tbl8TryCollapse(fib, idx);
+      } else {
+        fibSlot(fib.tbl24[idx], op.len, op.insert, op.ent);
+      }
+    }
+  } else {
+    uint32_t idx = prefix >> 8;
+    if (!(fib.tbl24[idx] & FIB_EXT)) {
+      if (!op.insert) return;
+      uint32_t group = tbl8Alloc(fib, fib.tbl24[idx]);
+      fib.tbl24[idx] = FIB_VALID | FIB_EXT | group;
+    }
+    uint32_t *g = &fib.tbl8[FIB_DATA(fib.tbl24[idx]) * TBL8_GROUP_SIZE];
+    uint32_t begin = prefix & 0xFF, end = begin + (1u << (32 - op.len));
+    for (uint32_t i = begin; i < end; ++i) fibSlot(g[i], op.len, op.insert, op.ent);
+    if (!op.insert) tbl8TryCollapse(fib, idx);
+  }
+}
+
+// apply `op` to the standby version and make it the active one
+static void fibPublish(const FibOp &op) {
+  Fib *active = fib_active.load();
+  Fib *standby = active == &fibs[0] ? &fibs[1] : &fibs[0];
+  if (!fib_log.empty()) {
+    // the standby one was active before the last publish, catch it up
+    fibSynchronize();
+    for (const FibOp &old : fib_log) fibApply(*standby, old);
+    fib_log.clear();
+    // neither version refers to the retired nexthops any more
+    nexthop_free.insert(nexthop_free.end(), nexthop_retired.begin(), nexthop_retired.end());
+    nexthop_retired.clear();
+  }
+  fibApply(*standby, op);
+  fib_log.push_back(op);
+  fib_active.store(standby);
+}
+
+/**
+ * @brief 插入或替换 FIB 中的一条路由，它将持有 entry.nexthop_id 的一个引用
+ */
+static void fibInsert(const FibEntry &entry) {
+  uint64_t key = routeKey(entry.addr, entry.len);
+  auto it = fib_routes.find(key);
+  uint32_t old_id = NEXTHOP_MAX;
+  if (it != fib_routes.end()) {
+    old_id = it->second.nexthop_id;
+    it->second = entry;
+  } else {
+    fib_routes[key] = entry;
+  }
+  fibPublish(FibOp{endianSwap(entry.addr), entry.len, true, FIB_ENTRY(entry.len, entry.nexthop_id)});
+  if (old_id != NEXTHOP_MAX) nexthopRelease(old_id);
+}
+
+/**
+ * @brief 从 FIB 中删除一条路由，它的位置交给覆盖它的最长的路由
+ */
+static void fibDelete(uint32_t addr, uint32_t len) {
+  auto it = fib_routes.find(routeKey(addr, len));
+  if (it == fib_routes.end()) return;
+  uint32_t id = it->second.nexthop_id;
+  fib_routes.erase(it);
+  uint32_t prefix = endianSwap(addr);
+  uint32_t ent = 0;
+  for (int l = (int)len - 1; l >= 0; --l) {
+    auto parent = fib_routes.find(routeKey(endianSwap(prefix & hostMask(l)), l));
+    if (parent != fib_routes.end()) {
+      ent = FIB_ENTRY(l, parent->second.nexthop_id);
+      break;
+    }
+  }
+  fibPublish(FibOp{prefix, len, false, ent});
+  nexthopRelease(id);
+}
+
+std::vector<RoutingTableEntry>::iterator find(const RoutingTableEntry &entry);
+
 /**
  * @brief 插入/删除一条路由表表项
  * @param insert 如果要插入则为 true ，要删除则为 false
@@ -30,49 +349,54 @@ std::vector<RoutingTableEntry> routing_table;
  * 
  * 插入时如果已经存在一条 addr 和 len 都相同的表项，则替换掉原有的。
  * 删除时按照 addr 和 len 匹配。
+ * 只有影响转发的变化（新路由、删除、nexthop 或 if_index 改变）才会更新 FIB，
+ * metric 和 timestamp 之类的变化只留在 RIB 中。
  */
 void update(bool insert, RoutingTableEntry entry) {
-  auto match = [&entry](const RoutingTableEntry &x) { return x.addr == entry.addr && x.len == entry.len; };
+  auto it = find(entry);
   if (insert) {
-    auto it = std::find_if(routing_table.begin(), routing_table.end(), match);
-    if (it != routing_table.end()) {
-      it->if_index = entry.if_index; // replace
-      it->nexthop = entry.nexthop;
+    if (it != routing_table.end() && it->nexthop == entry.nexthop && it->if_index == entry.if_index) {
+      *it = entry; // replace, forwarding is unaffected
+      return;
+    }
+    uint32_t id = nexthopAcquire(entry.nexthop, entry.if_index);
+    if (id == NEXTHOP_MAX) {
+      printf("\033[31m Fail to insert in routing table, too many nexthops.\033[0m\n");
+      return;
     }
-    else
+    if (it != routing_table.end()) {
+      *it = entry; // replace
+    } else {
+      route_index[routeKey(entry.addr, entry.len)] = routing_table.size();
       routing_table.push_back(entry);
+    }
+    fibInsert(FibEntry{entry.addr, (uint8_t)entry.len, 0, (uint16_t)id});
   }
   else {
-    auto it = std::find_if(routing_table.begin(), routing_table.end(), match);
     if (it == routing_table.end()) {
       printf("\033[31m Fail to delete in routing table, the entry is not found.\033[0m");
       printf("ip: %u.%u.%u.%u/%u \n", (uint8_t)entry.addr, (uint8_t)(entry.addr>>8), (uint8_t)(entry.addr>>16), (uint8_t)(entry.addr>>24), entry.len);
       return;
     }
-    routing_table.erase(it);
+    fibDelete(entry.addr, entry.len);
+    // move the last entry into the hole instead of shifting the whole vector
+    route_index.erase(routeKey(entry.addr, entry.len));
+    if (it != routing_table.end() - 1) {
+      *it = routing_table.back();
+      route_index[routeKey(it->addr, it->len)] = it - routing_table.begin();
+    }
+    routing_table.pop_back();
   }
 }
 
+/**
+ * @brief 按照 addr 和 len 精确查找路由表项
+ * @return 指向该表项的迭代器，找不到时为 routing_table.end()
+ */
 std::vector<RoutingTableEntry>::iterator find(const RoutingTableEntry &entry) {
-  auto match = [&entry](const RoutingTableEntry &x) { return x.addr == entry.addr && x.len == entry.len; };
-  return std::find_if(routing_table.begin(), routing_table.end(), match);
-}
-
-template<typename T>
-static void showBits(T a)
-{
-	auto b = (T *) (&a);  // low bit at right
-	for (int k = 8 * sizeof(T) - 1; k >= 0; --k) {
-		printf("%u", (bool) (*b & (1 << k)));
-	}
-}
-
-inline static uint32_t endianSwap(uint32_t a) {
-  return (a >> 24) | ((a & 0x00FF0000) >> 8) | ((a & 0x0000FF00) << 8) | ((a & 0x000000FF) << 24);
-}
-
-inline static uint32_t lenToMask(uint32_t len) {
-  return endianSwap((0xFFFFFFFF >> (32 - len)) << (32 - len));
+  auto it = route_index.find(routeKey(entry.addr, entry.len));
+  if (it == route_index.end()) return routing_table.end();
+  return routing_table.begin() + it->second;
 }
 
 /**
@@ -82,20 +406,87 @@ inline static uint32_t lenToMask(uint32_t len) {
  * @param if_index 如果查询到目标，把表项的 if_index 写入
  * @return 查到则返回 true ，没查到则返回 false
  */
+bool query_id(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *nexthop_id);
+
 bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) {
-  if(routing_table.empty()) return false;
+  uint32_t nexthop_id;
+  return query_id(addr, nexthop, if_index, &nexthop_id);
+}
 
-  auto rank = [addr](const RoutingTableEntry &entry) -> uint32_t { 
-    // return the number of matching bits, (start with lowbit)
-    uint32_t mask = lenToMask(entry.len);
-    return (addr & mask) == (entry.addr & mask) ? entry.len : 0;
-  };
+/**
+ * @brief 与 query 相同，另外给出表项的 nexthop 编号
+ * @param nexthop_id 如果查询到目标，把 nexthop 编号写入，编号在 [0, NEXTHOP_MAX) 内
+ *
+ * 相同的 (nexthop, if_index) 共用一个编号，可以用作按 nexthop 缓存信息的下标；
+ * 编号在不再被使用后可能分配给别的 nexthop，缓存时应一并记下 nexthop 和 if_index 加以核对。
+ */
+bool query_id(uint32_t addr, uint32_t *nexthop, uint32_t *if_index, uint32_t *nexthop_id) {
+  const Fib *fib = fibReadLock();
+  addr = endianSwap(addr);
+  uint32_t ent = fib->tbl24[addr >> 8];
+  if (ent & FIB_EXT) {
+    ent = fib->tbl8[FIB_DATA(ent) * TBL8_GROUP_SIZE + (addr & 0xFF)];
+  }
+  bool found = ent & FIB_VALID;
+  if (found) {
+    const NextHop &nh = nexthop_table[FIB_DATA(ent)];
+    *nexthop = nh.nexthop;
+    *if_index = nh.if_index;
+    *nexthop_id = FIB_DATA(ent);
+  }
+  fibReadUnlock();
+  return found;
+}
 
-  auto it = std::max_element(routing_table.begin(), routing_table.end(), 
-  [&rank](const RoutingTableEntry &x, const RoutingTableEntry &y) { return rank(x) < rank(y); });
+static const size_t QUERY_BATCH = 16;
 
-  if (rank(*it) == 0) return false; // not found
-  *nexthop = it->nexthop;
-  *if_index = it->if_index;
-  return true;
+/**
+ * @brief 批量进行路由表查询，结果与逐个调用 query 相同
+ * @param addrs 需要查询的 n 个目标地址，大端序
+ * @param n 地址个数
+ * @param nexthops 第 i 个地址查到时写入对应表项的 nexthop
+ * @param if_indexes 第 i 个地址查到时写入对应表项的 if_index
+ * @param found 第 i 个地址是否查到
+ *
+ * 每 QUERY_BATCH 个地址为一组，逐级预取下一级的表项，使一组内各个查询的访存互相重叠。
+ * 整批查询都在同一个版本的表上完成。
+ */
+void query_batch(const uint32_t *addrs, size_t n, uint32_t *nexthops, uint32_t *if_indexes, bool *found) {
+  const Fib *fib = fibReadLock();
+  uint32_t host[QUERY_BATCH];
+  uint32_t ent[QUERY_BATCH];
+  for (size_t base = 0; base < n; base += QUERY_BATCH) {
+    size_t m = std::min(n - base, QUERY_BATCH);
+    // 1. tbl24
+    for (size_t i = 0; i < m; ++i) {
+      host[i] = endianSwap(addrs[base + i]);
+      __builtin_prefetch(&fib->tbl24[host[i] >> 8]);
+    }
+    // 2. tbl8 group or nexthop
+    for (size_t i = 0; i < m; ++i) {
+      ent[i] = fib->tbl24[host[i] >> 8];
+      if (ent[i] & FIB_EXT) {
+        __builtin_prefetch(&fib->tbl8[FIB_DATA(ent[i]) * TBL8_GROUP_SIZE + (host[i] & 0xFF)]);
+      } else if (ent[i] & FIB_VALID) {
+        __builtin_prefetch(&nexthop_table[FIB_DATA(ent[i])]);
+      }
+    }
+    // 3. nexthop of the expanded ones
+    for (size_t i = 0; i < m; ++i) {
+      if (ent[i] & FIB_EXT) {
+        ent[i] = fib->tbl8[FIB_DATA(ent[i]) * TBL8_GROUP_SIZE + (host[i] & 0xFF)];
+        if (ent[i] & FIB_VALID) __builtin_prefetch(&nexthop_table[FIB_DATA(ent[i])]);
+      }
+    }
+    // 4. fill results
+    for (size_t i = 0; i < m; ++i) {
+      found[base + i] = ent[i] & FIB_VALID;
+      if (found[base + i]) {
+        const NextHop &nh = nexthop_table[FIB_DATA(ent[i])];
+        nexthops[base + i] = nh.nexthop;
+        if_indexes[base + i] = nh.if_index;
+      }
+    }
+  }
+  fibReadUnlock();
 }
@@ -3,15 +3,41 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 extern void update(bool insert, RoutingTableEntry entry);
 extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+extern void query_batch(const uint32_t *addrs, size_t n, uint32_t *nexthops, uint32_t *if_indexes, bool *found);
 char buffer[1024];
 
+// consecutive Q lines collected in batch mode (-b)
+const size_t BATCH_SIZE = 64;
+uint32_t batch_addrs[BATCH_SIZE];
+uint32_t batch_nexthops[BATCH_SIZE];
+uint32_t batch_if_indexes[BATCH_SIZE];
+bool batch_found[BATCH_SIZE];
+size_t batch_len = 0;
+
+void flushBatch() {
+  query_batch(batch_addrs, batch_len, batch_nexthops, batch_if_indexes, batch_found);
+  for (size_t i = 0; i < batch_len; i++) {
+    if (batch_found[i]) {
+      printf("0x%08x %d\n", batch_nexthops[i], batch_if_indexes[i]);
+    } else {
+      printf("Not Found\n");
+    }
+  }
+  batch_len = 0;
+}
+
 int main(int argc, char *argv[]) {
+  bool batch = argc > 1 && strcmp(argv[1], "-b") == 0;
   uint32_t addr, len, if_index, nexthop;
   char tmp;
   while (fgets(buffer, sizeof(buffer), stdin)) {
+    if (batch_len > 0 && (buffer[0] != 'Q' || batch_len == BATCH_SIZE)) {
+      flushBatch();
+    }
     if (buffer[0] == 'I') {
       sscanf(buffer, "%c,%x,%d,%d,%x", &tmp, &addr, &len, &if_index, &nexthop);
       RoutingTableEntry entry = {
@@ -29,12 +55,17 @@ int main(int argc, char *argv[]) {
       update(false, entry);
     } else if (buffer[0] == 'Q') {
       sscanf(buffer, "%c,%x", &tmp, &addr);
-      if (query(addr, &nexthop, &if_index)) {
+      if (batch) {
+        batch_addrs[batch_len++] = addr;
+      } else if (query(addr, &nexthop, &if_index)) {
         printf("0x%08x %d\n", nexthop, if_index);
       } else {
         printf("Not Found\n");
       }
     }
   }
+  if (batch_len > 0) {
+    flushBatch();
+  }
   return 0;
-}
\ No newline at end of file
+}
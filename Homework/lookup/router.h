@@ -2,12 +2,23 @@
 #define _ROUTER_H
 
 #include <stdint.h>
+// RIB entry: a route and its control plane state
 typedef struct {
     uint32_t addr;
     uint32_t len;
     uint32_t if_index;
-    uint32_t nexthop;
-    uint8_t  metric; // [0..16]
+    uint32_t nexthop;   // for learned routes, also the neighbor we learned it from
+    uint8_t  metric;    // [0..16]
+    uint64_t timestamp; // HAL_GetTicks() of the last refresh, 0 for routes that never expire
 } RoutingTableEntry;
 
-#endif
\ No newline at end of file
+// FIB entry: only what forwarding needs, kept for the best route of each prefix
+#define NEXTHOP_MAX 65536 // nexthop ids are in [0, NEXTHOP_MAX)
+typedef struct {
+    uint32_t addr;
+    uint8_t  len;
+    uint8_t  reserved;
+    uint16_t nexthop_id; // index into the nexthop table
+} FibEntry;
+
+#endif
@@ -1,4 +1,5 @@
 #include "rip.h"
+#include "router_checksum.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <cstdio>
@@ -60,6 +61,18 @@ bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
   const uint32_t ip_hlen = (packet[0] & 0b00001111) * 4;  // in byte
   constexpr uint32_t udp_hlen = 8; // bytes
   constexpr uint32_t ripentry_size = 20; // bytes
+  MAKE_SURE(len >= ip_hlen + udp_hlen);
+  // udp checksum over pseudo header + segment, 0 means the sender left it out
+  const uint8_t *udp = packet + ip_hlen;
+  const uint32_t udp_len = (udp[4] << 8) + udp[5];
+  if (udp[6] != 0 || udp[7] != 0) {
+    MAKE_SURE(udp_hlen <= udp_len && udp_len <= len - ip_hlen);
+    const uint8_t pseudo[4] = {0, packet[9], udp[4], udp[5]};
+    uint64_t sum = checksumPartial(&packet[12], 8, 0); // src, dst
+    sum = checksumPartial(pseudo, sizeof(pseudo), sum);
+    sum = checksumPartial(udp, udp_len, sum);
+    MAKE_SURE(checksumFold(sum) == 0xFFFF);
+  }
   packet += ip_hlen + udp_hlen;  // skip ip head and udp head
   const uint32_t ripentry_tot_size = (len - ip_hlen - udp_hlen - 4);
   MAKE_SURE(ripentry_tot_size % ripentry_size == 0);
@@ -100,21 +113,35 @@ bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
  * 你写入 buffer 的数据长度和返回值都应该是四个字节的 RIP 头，加上每项 20 字节。
  * 需要注意一些没有保存在 RipPacket 结构体内的数据的填写。
  */
+uint32_t assemble(const RipPacket *rip, uint8_t *buffer, uint64_t *sum);
+
 uint32_t assemble(const RipPacket *rip, uint8_t *buffer) {
+  uint64_t sum;
+  return assemble(rip, buffer, &sum);
+}
+
+// same as above, also returns the unfolded checksum of the bytes written in
+// *sum, accumulated from the values as they are stored (see checksumPartial)
+uint32_t assemble(const RipPacket *rip, uint8_t *buffer, uint64_t *sum) {
   uint32_t p = 0;
+  uint64_t acc = 0;
+  uint32_t word;
   // rip head
   buffer[p++] = rip->command;
   buffer[p++] = 2; // RIPv2 version
   buffer[p++] = 0;
   buffer[p++] = 0; // zero
+  memcpy(&word, &buffer[0], sizeof(word));
+  acc += word;
+  // family and tag are the same for every entry
+  const uint8_t family_tag[4] = {0, (uint8_t)(rip->command == CMD_RESPONSE ? 2 : 0), 0, 0};
+  memcpy(&word, family_tag, sizeof(word));
+  acc += (uint64_t)word * rip->numEntries;
   for (uint32_t i = 0; i < rip->numEntries; ++i) {
     const RipEntry &e = rip->entries[i];
-    // family
-    buffer[p++] = 0;
-    buffer[p++] = rip->command == CMD_RESPONSE ? 2 : 0;
-    // tag
-    buffer[p++] = 0;
-    buffer[p++] = 0;
+    // family, tag
+    memcpy(&buffer[p], family_tag, sizeof(family_tag));
+    p += 4;
     // ip
     memcpy(&buffer[p], &e.addr, sizeof(e.addr));
     p += 4;
@@ -127,6 +154,8 @@ uint32_t assemble(const RipPacket *rip, uint8_t *buffer) {
     // metric
     memcpy(&buffer[p], &e.metric, sizeof(e.metric));
     p += 4;
+    acc += (uint64_t)e.addr + e.mask + e.nexthop + e.metric;
   }
+  *sum = acc;
   return p;
 }